@@ -16,6 +16,7 @@
 
 #include "ch.h"
 #include "hal.h"
+#include "card.h"
 
 /**
  * @brief   PAL setup.
@@ -60,6 +61,29 @@ bool mmc_lld_is_write_protected(MMCDriver *mmcp) {
 }
 #endif
 
+#if HAL_USE_SDC
+/* Board-related functions related to the SDC driver. SDIO cannot tell
+   whether a card is in: the card detect switch is read where it is wired
+   (CARD_DETECT_PORT), otherwise a card is always reported, main.c then
+   retries a connection that fails and a removal only shows as read
+   errors.*/
+bool sdc_lld_is_card_inserted(SDCDriver *sdcp) {
+
+  (void)sdcp;
+#if defined(CARD_DETECT_PORT)
+  return palReadPad(CARD_DETECT_PORT, CARD_DETECT_PAD) == CARD_DETECT_ACTIVE;
+#else
+  return TRUE;
+#endif
+}
+
+bool sdc_lld_is_write_protected(SDCDriver *sdcp) {
+
+  (void)sdcp;
+  return FALSE;
+}
+#endif
+
 /*
  * Board-specific initialization code.
  */
@@ -102,10 +102,16 @@
 
 /**
  * @brief   Enables the MMC_SPI subsystem.
+ * @note    The card is on SPI2 on this board, unless built for SDIO with
+ *          HAL_USE_SDC set TRUE, see HAL_USE_SDC.
  */
 #if !defined(HAL_USE_MMC_SPI) || defined(__DOXYGEN__)
+#if defined(HAL_USE_SDC) && HAL_USE_SDC
+#define HAL_USE_MMC_SPI             FALSE
+#else
 #define HAL_USE_MMC_SPI             TRUE
 #endif
+#endif
 
 /**
  * @brief   Enables the PWM subsystem.
@@ -123,6 +129,8 @@
 
 /**
  * @brief   Enables the SDC subsystem.
+ * @note    Selects the SDIO card backend of card.h, for boards with the
+ *          card on SDIO: build with CARD_SDIO = yes in the Makefile.
  */
 #if !defined(HAL_USE_SDC) || defined(__DOXYGEN__)
 #define HAL_USE_SDC                 FALSE
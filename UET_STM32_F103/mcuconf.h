@@ -161,6 +161,18 @@
 #define STM32_SERIAL_UART4_PRIORITY         12
 #define STM32_SERIAL_UART5_PRIORITY         12
 
+/*
+ * SDC driver system settings.
+ * SDIO is on DMA2 channel 4 as DAC1 CH2, which the player only uses in
+ * dual mode through the CH1 stream.
+ */
+#define STM32_SDC_SDIO_DMA_PRIORITY         3
+#define STM32_SDC_SDIO_IRQ_PRIORITY         9
+#define STM32_SDC_WRITE_TIMEOUT_MS          250
+#define STM32_SDC_READ_TIMEOUT_MS           100
+#define STM32_SDC_CLOCK_ACTIVATION_DELAY    10
+#define STM32_SDC_SDIO_UNALIGNED_SUPPORT    TRUE
+
 /*
  * SPI driver system settings.
  */
@@ -0,0 +1,57 @@
+/*
+ * card.h
+ *
+ * The block device the FatFs volume is on, chosen per board by its
+ * halconf.h: the SDIO card driver on a 4 bit bus where the board enables
+ * HAL_USE_SDC, MMC over SPI otherwise. Both are ChibiOS block devices,
+ * the FatFs binding (cardDiskio.c) and the card monitor of main.c only
+ * use the blk*() interface but for the SPI specific parts. The host
+ * simulation selects CARD_HOST, a block device over a disk image file.
+ */
+
+#ifndef CARD_H_
+#define CARD_H_
+
+#define CARD_MMC_SPI                0
+#define CARD_SDC                    1
+#define CARD_HOST                   2
+
+#define CARD_BLOCK_SIZE             512
+
+/*
+ * Level of the card detect pad with a card in, on boards that have the
+ * switch wired (CARD_DETECT_PORT, see main.c).
+ */
+#if !defined(CARD_DETECT_ACTIVE)
+#define CARD_DETECT_ACTIVE          PAL_LOW
+#endif
+
+#if !defined(CARD_BACKEND)
+#if HAL_USE_SDC
+#define CARD_BACKEND                CARD_SDC
+#else
+#define CARD_BACKEND                CARD_MMC_SPI
+#endif
+#endif
+
+#if CARD_BACKEND == CARD_SDC
+#if !HAL_USE_SDC
+#error "CARD_SDC requires HAL_USE_SDC"
+#endif
+#define CARD_DRIVER                 SDCD1
+#define CARD_NAME                   "SDIO"
+#elif CARD_BACKEND == CARD_MMC_SPI
+#if !HAL_USE_MMC_SPI
+#error "CARD_MMC_SPI requires HAL_USE_MMC_SPI"
+#endif
+#define CARD_DRIVER                 MMCD1
+#define CARD_NAME                   "MMC/SPI"
+extern MMCDriver MMCD1;
+#elif CARD_BACKEND == CARD_HOST
+#define CARD_DRIVER                 HBD1
+#define CARD_NAME                   "host"
+#else
+#error "unknown CARD_BACKEND"
+#endif
+
+#endif /* CARD_H_ */
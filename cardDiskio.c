@@ -0,0 +1,238 @@
+/*
+ * cardDiskio.c
+ *
+ * FatFs disk I/O for the card block device of card.h, in place of the
+ * ChibiOS FatFs bindings. Over SDIO, and on the host, reads go to the
+ * block device as they are, the SDC driver moves them by DMA on the 4 bit
+ * bus. Over SPI reads do not go through mmcSequentialRead(), which polls
+ * for the data token one SPI transfer per byte, each one a DMA set-up and
+ * an interrupt: here the token is polled MMC_POLL_BYTES at a time, the
+ * thread sleeps between polls once the card is slow to answer, and the
+ * rest of the block goes by DMA straight into the FatFs buffer.
+ * The wait stays a timed poll, SPI has no interrupt for the token: one
+ * transfer and interrupt per MMC_POLL_BYTES polled, then a tick of sleep
+ * per poll past MMC_POLL_SPINS. It takes less CPU, not none.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "ff.h"
+#include "diskio.h"
+#include "card.h"
+
+#include <string.h>
+
+#if CARD_BACKEND == CARD_MMC_SPI
+
+/**
+ * @brief   Bytes received per data token poll.
+ */
+#if !defined(MMC_POLL_BYTES) || defined(__DOXYGEN__)
+#define MMC_POLL_BYTES              8
+#endif
+
+/**
+ * @brief   Polls spun before sleeping a tick between them.
+ * @details A token is usually a few hundred microseconds away, unless the
+ *          card is busy e.g. erasing blocks. The one tick sleep is the
+ *          intended trade-off: it gives the CPU away during a long wait
+ *          at the cost of up to a tick of read latency.
+ */
+#if !defined(MMC_POLL_SPINS) || defined(__DOXYGEN__)
+#define MMC_POLL_SPINS              32
+#endif
+
+/**
+ * @brief   Data token timeout in milliseconds, as the SD spec read timeout.
+ */
+#if !defined(MMC_READ_TIMEOUT) || defined(__DOXYGEN__)
+#define MMC_READ_TIMEOUT            100
+#endif
+
+#if MMC_POLL_BYTES < 1 || MMC_POLL_BYTES > 64
+#error "MMC_POLL_BYTES must be 1 to 64"
+#endif
+
+#define MMC_START_TOKEN             0xFE
+
+/* CMD12 and the stuff byte that follows it.*/
+static const uint8_t stopcmd[] = {0x40 | MMCSD_CMD_STOP_TRANSMISSION,
+                                  0, 0, 0, 0, 0xFF, 0xFF};
+
+/*
+ * Waits for the card to release the bus, after a stop transmission.
+ */
+static bool wait_ready(SPIDriver *spip) {
+  systime_t start = chVTGetSystemTimeX();
+  uint8_t b;
+
+  while (TRUE) {
+    spiReceive(spip, 1, &b);
+    if (b == 0xFF)
+      return TRUE;
+    if (chVTGetSystemTimeX() - start >= MS2ST(MMC_READ_TIMEOUT))
+      return FALSE;
+    chThdSleep(1);
+  }
+}
+
+static void send_cmd(SPIDriver *spip, uint8_t cmd, uint32_t arg) {
+  uint8_t buf[6];
+
+  /* CRCs are off in SPI mode but for CMD0 and CMD8.*/
+  buf[0] = 0x40 | cmd;
+  buf[1] = (uint8_t)(arg >> 24);
+  buf[2] = (uint8_t)(arg >> 16);
+  buf[3] = (uint8_t)(arg >> 8);
+  buf[4] = (uint8_t)arg;
+  buf[5] = 0xFF;
+  spiSend(spip, sizeof(buf), buf);
+}
+
+static uint8_t recv_r1(SPIDriver *spip) {
+  uint8_t r1;
+  unsigned i;
+
+  for (i = 0; i < 9; i++) {
+    spiReceive(spip, 1, &r1);
+    if (r1 != 0xFF)
+      return r1;
+  }
+  return 0xFF;
+}
+
+/*
+ * Waits for the start token of a data block. The bytes of the block that
+ * came in along with the token are moved to "buf", their count returned,
+ * -1 on an error token or a timeout.
+ */
+static int wait_token(SPIDriver *spip, uint8_t *buf) {
+  uint8_t poll[MMC_POLL_BYTES];
+  systime_t start = chVTGetSystemTimeX();
+  unsigned spins = 0;
+  size_t i;
+
+  while (TRUE) {
+    spiReceive(spip, sizeof(poll), poll);
+    for (i = 0; i < sizeof(poll) && poll[i] == 0xFF; i++)
+      ;
+    if (i < sizeof(poll)) {
+      if (poll[i++] != MMC_START_TOKEN)
+        return -1;
+      memcpy(buf, poll + i, sizeof(poll) - i);
+      return (int)(sizeof(poll) - i);
+    }
+    if (chVTGetSystemTimeX() - start >= MS2ST(MMC_READ_TIMEOUT))
+      return -1;
+    if (spins < MMC_POLL_SPINS)
+      spins++;
+    else
+      chThdSleep(1);
+  }
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+  MMCDriver *mmcp = &MMCD1;
+  SPIDriver *spip = mmcp->config->spip;
+  DRESULT res = RES_OK;
+  bool multi = count > 1;
+  int n;
+
+  if (pdrv != 0 || blkGetDriverState(mmcp) != BLK_READY)
+    return RES_NOTRDY;
+
+  /* The driver is bypassed, it must not start anything meanwhile.*/
+  mmcp->state = BLK_READING;
+  spiStart(spip, mmcp->config->hscfg);
+  spiSelect(spip);
+  if (!mmcp->block_addresses)
+    sector *= MMCSD_BLOCK_SIZE;
+  send_cmd(spip, multi ? MMCSD_CMD_READ_MULTIPLE_BLOCK : MMCSD_CMD_READ_SINGLE_BLOCK,
+           sector);
+  if (recv_r1(spip) != 0x00) {
+    multi = FALSE;
+    res = RES_ERROR;
+  }
+  for (; res == RES_OK && count > 0; count--, buff += MMCSD_BLOCK_SIZE) {
+    n = wait_token(spip, buff);
+    if (n < 0) {
+      res = RES_ERROR;
+      break;
+    }
+    spiReceive(spip, MMCSD_BLOCK_SIZE - n, buff + n);
+    /* CRC ignored.*/
+    spiIgnore(spip, 2);
+  }
+  if (multi) {
+    spiSend(spip, sizeof(stopcmd), stopcmd);
+    if (recv_r1(spip) != 0x00 || !wait_ready(spip))
+      res = RES_ERROR;
+  }
+  spiUnselect(spip);
+  mmcp->state = BLK_READY;
+  return res;
+}
+
+#else /* CARD_BACKEND != CARD_MMC_SPI */
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+  if (pdrv != 0 || blkGetDriverState(&CARD_DRIVER) != BLK_READY)
+    return RES_NOTRDY;
+  if (blkRead(&CARD_DRIVER, sector, buff, count) != HAL_SUCCESS)
+    return RES_ERROR;
+  return RES_OK;
+}
+
+#endif /* CARD_BACKEND != CARD_MMC_SPI */
+
+DSTATUS disk_initialize(BYTE pdrv) {
+  return disk_status(pdrv);
+}
+
+DSTATUS disk_status(BYTE pdrv) {
+  DSTATUS stat = 0;
+
+  if (pdrv != 0)
+    return STA_NOINIT;
+  if (blkGetDriverState(&CARD_DRIVER) != BLK_READY)
+    stat |= STA_NOINIT;
+  if (blkIsWriteProtected(&CARD_DRIVER))
+    stat |= STA_PROTECT;
+  return stat;
+}
+
+#if !_FS_READONLY
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+  (void)pdrv;
+  (void)buff;
+  (void)sector;
+  (void)count;
+  return RES_WRPRT;
+}
+#endif
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+  BlockDeviceInfo bdi;
+
+  if (pdrv != 0 || blkGetDriverState(&CARD_DRIVER) != BLK_READY)
+    return RES_NOTRDY;
+  switch (cmd) {
+  case CTRL_SYNC:
+    return RES_OK;
+  case GET_SECTOR_COUNT:
+    if (blkGetInfo(&CARD_DRIVER, &bdi) != HAL_SUCCESS)
+      return RES_ERROR;
+    *((DWORD *)buff) = bdi.blk_num;
+    return RES_OK;
+  case GET_SECTOR_SIZE:
+    *((WORD *)buff) = CARD_BLOCK_SIZE;
+    return RES_OK;
+  case GET_BLOCK_SIZE:
+    /* Unknown erase block size.*/
+    *((DWORD *)buff) = 256;
+    return RES_OK;
+  default:
+    return RES_PARERR;
+  }
+}
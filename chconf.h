@@ -451,6 +451,9 @@
  * @note    This macro can be used to activate a power saving mode.
  */
 #define CH_CFG_IDLE_ENTER_HOOK() {                                          \
+  /* Idle time accounting, see cmd_cpu() in main.c.*/                       \
+  extern rtcnt_t idleSince;                                                 \
+  idleSince = chSysGetRealtimeCounterX();                                   \
 }
 
 /**
@@ -460,6 +463,8 @@
  * @note    This macro can be used to deactivate a power saving mode.
  */
 #define CH_CFG_IDLE_LEAVE_HOOK() {                                          \
+  extern rtcnt_t idleSince, idleTotal;                                      \
+  idleTotal += chSysGetRealtimeCounterX() - idleSince;                      \
 }
 
 /**
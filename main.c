@@ -21,8 +21,12 @@
 #include "shell.h"
 #include "chprintf.h"
 #include "wave/wavePlayer.h"
+#include "wave/waveSource.h"
+#include "wave/soundBank.h"
+#include "card.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define CONSOLE			SD1
@@ -75,14 +79,70 @@
 #endif
 
 /**
- * @brief   Card monitor timer.
+ * @brief   Fastest SPI clock divider tried after bring-up, as the BR field
+ *          of CR1: 0 is PCLK/2, 7 is PCLK/256.
+ */
+#if !defined(MMC_SPI_DIV_MIN) || defined(__DOXYGEN__)
+#define MMC_SPI_DIV_MIN             0
+#endif
+
+/**
+ * @brief   Blocks read back at each divider while probing.
+ */
+#if !defined(MMC_PROBE_BLOCKS) || defined(__DOXYGEN__)
+#define MMC_PROBE_BLOCKS            8
+#endif
+
+/**
+ * @brief   Passes over the probe blocks a divider has to survive.
+ */
+#if !defined(MMC_PROBE_PASSES) || defined(__DOXYGEN__)
+#define MMC_PROBE_PASSES            4
+#endif
+
+/**
+ * @brief   Card detect switch, where the board has one: its pad, e.g. in
+ *          board.h, along with CARD_DETECT_PAD and CARD_DETECT_EXT, the
+ *          EXT_MODE_GPIOx of the port. Needs HAL_USE_EXT, the card is
+ *          polled otherwise.
+ */
+#if defined(CARD_DETECT_PORT) || defined(__DOXYGEN__)
+#define CARD_DETECT                 TRUE
+#else
+#define CARD_DETECT                 FALSE
+#endif
+
+/**
+ * @brief   Time, in milliseconds, the card detect switch must be steady
+ *          for before a change is reported.
+ */
+#if !defined(CARD_DETECT_DEBOUNCE) || defined(__DOXYGEN__)
+#define CARD_DETECT_DEBOUNCE        50
+#endif
+
+/**
+ * @brief   Longest wait, in milliseconds, for a transfer in progress to end
+ *          on a removal before the card is disconnected.
+ */
+#if !defined(CARD_REMOVE_TIMEOUT) || defined(__DOXYGEN__)
+#define CARD_REMOVE_TIMEOUT         500
+#endif
+
+#if CARD_DETECT && !HAL_USE_EXT
+#error "CARD_DETECT_PORT requires HAL_USE_EXT"
+#endif
+
+/**
+ * @brief   Card monitor timer, polling or debouncing the switch.
  */
 static virtual_timer_t tmr;
 
+#if !CARD_DETECT
 /**
  * @brief   Debounce counter.
  */
 static unsigned cnt;
+#endif
 
 /**
  * @brief   Card event sources.
@@ -90,6 +150,80 @@ static unsigned cnt;
 static EVENTSOURCE_DECL(inserted_event);
 static EVENTSOURCE_DECL(removed_event);
 
+#if CARD_DETECT
+/**
+ * @brief   Card detect switch state last reported.
+ */
+static bool card_in;
+
+/**
+ * @brief   Debounce timer callback function, the switch has been steady
+ *          for CARD_DETECT_DEBOUNCE.
+ *
+ * @notapi
+ */
+static void tmrfunc(void *p) {
+  bool in = palReadPad(CARD_DETECT_PORT, CARD_DETECT_PAD) == CARD_DETECT_ACTIVE;
+
+  (void)p;
+  chSysLockFromISR();
+  if (in != card_in) {
+    card_in = in;
+    chEvtBroadcastI(in ? &inserted_event : &removed_event);
+  }
+  chSysUnlockFromISR();
+}
+
+/**
+ * @brief   Card detect edge callback, (re)starts the debounce timer.
+ *
+ * @notapi
+ */
+static void cd_edge(EXTDriver *extp, expchannel_t channel) {
+
+  (void)extp;
+  (void)channel;
+  chSysLockFromISR();
+  chVTSetI(&tmr, MS2ST(CARD_DETECT_DEBOUNCE), tmrfunc, NULL);
+  chSysUnlockFromISR();
+}
+
+static const EXTConfig extcfg = {
+  {
+    [CARD_DETECT_PAD] = {EXT_CH_MODE_BOTH_EDGES | EXT_CH_MODE_AUTOSTART |
+                         CARD_DETECT_EXT, cd_edge}
+  }
+};
+
+/**
+ * @brief   Switch monitor start, the state at start is reported as a
+ *          change.
+ *
+ * @notapi
+ */
+static void tmr_init(void *p) {
+
+  (void)p;
+  extStart(&EXTD1, &extcfg);
+  chSysLock();
+  chVTSetI(&tmr, MS2ST(CARD_DETECT_DEBOUNCE), tmrfunc, NULL);
+  chSysUnlock();
+}
+
+/**
+ * @brief   Reports the card as inserted again in a while, after it failed
+ *          to connect or mount.
+ *
+ * @notapi
+ */
+static void tmr_retry(void) {
+  chSysLock();
+  card_in = FALSE;
+  chVTSetI(&tmr, MS2ST(MMC_POLLING_DELAY * MMC_POLLING_INTERVAL), tmrfunc, NULL);
+  chSysUnlock();
+}
+
+#else /* !CARD_DETECT */
 /**
  * @brief   Insertion monitor timer callback function.
  *
@@ -106,6 +240,14 @@ static void tmrfunc(void *p) {
      the transfer.*/
   blkstate_t state = blkGetDriverState(bbdp);
   chSysLockFromISR();
+  /* Nor while the player streams from the card, which would mostly be
+     skipped anyway. The timer is left off until tmr_resume(), a removal
+     meanwhile ends the playback with read errors. Sounds played from
+     the flash bank do not hold the card and leave the polling on.*/
+  if (cnt == 0 && fileSourceCount() > 0) {
+    chSysUnlockFromISR();
+    return;
+  }
   if ((state != BLK_READING) && (state != BLK_WRITING)) {
     /* Safe to perform the check.*/
     if (cnt > 0) {
@@ -142,6 +284,35 @@ static void tmr_init(void *p) {
   chSysUnlock();
 }
 
+/**
+ * @brief   Polling monitor restart, once the player has closed its files.
+ *
+ * @param[in] p         pointer to an object implementing @p BaseBlockDevice
+ *
+ * @notapi
+ */
+static void tmr_resume(void *p) {
+  chSysLock();
+  if (fileSourceCount() == 0 && !chVTIsArmedI(&tmr))
+    chVTSetI(&tmr, MS2ST(MMC_POLLING_DELAY), tmrfunc, p);
+  chSysUnlock();
+}
+
+/**
+ * @brief   Reports the card as inserted again in a while, after it failed
+ *          to connect or mount. Boards that cannot sense the card, e.g. on
+ *          SDIO without a switch, always report one and would otherwise
+ *          never try again.
+ *
+ * @notapi
+ */
+static void tmr_retry(void) {
+  chSysLock();
+  cnt = MMC_POLLING_INTERVAL;
+  chSysUnlock();
+}
+#endif /* !CARD_DETECT */
+
 /*===========================================================================*/
 /* FatFs related.                                                            */
 /*===========================================================================*/
@@ -151,23 +322,109 @@ static void tmr_init(void *p) {
  */
 FATFS MMC_FS;
 
+#if CARD_BACKEND == CARD_MMC_SPI
 /**
  * MMC driver instance.
  */
 MMCDriver MMCD1;
+#endif
 
 /* FS mounted and ready.*/
 bool fs_ready = FALSE;
 
-static const SPIConfig hs_spicfg = {NULL, GPIOB, GPIOB_PIN12, 0};
-static const SPIConfig ls_spicfg = {NULL, GPIOB, GPIOB_PIN12, SPI_CR1_BR_2 | SPI_CR1_BR_1};
+/* Realtime counter cycles spent in the idle thread, kept by the idle hooks
+   of chconf.h. Interrupts served while idle count as idle.*/
+rtcnt_t idleSince, idleTotal;
+
+#if CARD_BACKEND == CARD_MMC_SPI
+/* Low speed divider, for the card initialization.*/
+#define LS_SPI_DIV      6
+
+/* The high speed divider is set by mmc_tune_clock() on each insertion.*/
+static SPIConfig hs_spicfg = {NULL, GPIOB, GPIOB_PIN12, 0};
+static const SPIConfig ls_spicfg = {NULL, GPIOB, GPIOB_PIN12, LS_SPI_DIV * SPI_CR1_BR_0};
+static unsigned spiDiv = LS_SPI_DIV;
 
 /* MMC/SD over SPI driver configuration.*/
 static const MMCConfig mmccfg = {&SPID2, &ls_spicfg, &hs_spicfg};
+#endif
+
+#if CARD_BACKEND == CARD_SDC
+/* SDIO driver configuration, no scratchpad for MMC cards.*/
+static const SDCConfig sdccfg = {NULL, SDC_MODE_4BIT};
+#endif
 
 /* Generic large buffer.*/
 uint8_t fbuff[256];
 
+/* One card block, for the clock probe and the benchmark.*/
+static uint8_t blkbuf[MMC_SECTOR_SIZE];
+
+#if CARD_BACKEND == CARD_MMC_SPI
+/*
+ * CRC16-CCITT, the polynomial of the SD data blocks.
+ */
+static uint16_t crc16(const uint8_t *p, size_t n) {
+  uint16_t crc = 0;
+  unsigned i;
+
+  while (n--) {
+    crc ^= (uint16_t)(*p++ << 8);
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+/*
+ * Reads the probe blocks, returns FALSE on a read error.
+ */
+static bool probe_read(uint16_t *crcs) {
+  unsigned i;
+
+  for (i = 0; i < MMC_PROBE_BLOCKS; i++) {
+    if (blkRead(&MMCD1, i, blkbuf, 1) != HAL_SUCCESS)
+      return FALSE;
+    crcs[i] = crc16(blkbuf, MMC_SECTOR_SIZE);
+  }
+  return TRUE;
+}
+
+/*
+ * Switches the SPI clock of the connected card to "div".
+ */
+static void mmc_set_div(unsigned div) {
+  spiDiv = div;
+  hs_spicfg.cr1 = (uint16_t)(div * SPI_CR1_BR_0);
+  spiStart(mmccfg.spip, &hs_spicfg);
+}
+
+/*
+ * Looks for the fastest SPI clock the card and the wiring take: the probe
+ * blocks are read at the initialization clock, then at each divider from
+ * MMC_SPI_DIV_MIN on until MMC_PROBE_PASSES passes read them back without
+ * an error and with the same CRCs. The MMC driver does not check the data
+ * CRC of the card, the comparison stands in for it.
+ */
+static void mmc_tune_clock(void) {
+  uint16_t ref[MMC_PROBE_BLOCKS], crcs[MMC_PROBE_BLOCKS];
+  unsigned div, pass;
+
+  mmc_set_div(LS_SPI_DIV);
+  if (!probe_read(ref))
+    return;
+  for (div = MMC_SPI_DIV_MIN; div < LS_SPI_DIV; div++) {
+    mmc_set_div(div);
+    for (pass = 0; pass < MMC_PROBE_PASSES; pass++)
+      if (!probe_read(crcs) || memcmp(crcs, ref, sizeof(ref)))
+        break;
+    if (pass == MMC_PROBE_PASSES)
+      return;
+  }
+  mmc_set_div(LS_SPI_DIV);
+}
+#endif /* CARD_BACKEND == CARD_MMC_SPI */
+
 static FRESULT scan_files(BaseSequentialStream *chp, char *path) {
   FRESULT res;
   FILINFO fno;
@@ -224,6 +481,23 @@ static void cmd_mem(BaseSequentialStream *chp, int argc, char *argv[]) {
   chprintf(chp, "heap free total  : %u bytes\r\n", size);
 }
 
+#if CH_DBG_FILL_THREADS
+/*
+ * Stack never used by a thread: the fill pattern left above its thread_t,
+ * at the bottom of the working area. The main thread has none.
+ */
+static uint32_t stack_free(thread_t *tp) {
+  const uint8_t *base = (const uint8_t *)(tp + 1);
+  const uint8_t *p = base;
+
+  if (tp == &ch.mainthread)
+    return 0;
+  while (p < (const uint8_t *)tp->p_ctx.r13 && *p == CH_DBG_STACK_FILL_VALUE)
+    p++;
+  return (uint32_t)(p - base);
+}
+#endif
+
 static void cmd_threads(BaseSequentialStream *chp, int argc, char *argv[]) {
   static const char *states[] = {CH_STATE_NAMES};
   thread_t *tp;
@@ -233,13 +507,18 @@ static void cmd_threads(BaseSequentialStream *chp, int argc, char *argv[]) {
     chprintf(chp, "Usage: threads\r\n");
     return;
   }
-  chprintf(chp, "    addr    stack prio refs     state time\r\n");
+  chprintf(chp, "    addr    stack prio refs     state  free\r\n");
   tp = chRegFirstThread();
   do {
-    chprintf(chp, "%08lx %08lx %4lu %4lu %9s\r\n",
+    chprintf(chp, "%08lx %08lx %4lu %4lu %9s %5lu\r\n",
             (uint32_t)tp, (uint32_t)tp->p_ctx.r13,
             (uint32_t)tp->p_prio, (uint32_t)(tp->p_refs - 1),
-            states[tp->p_state]);
+            states[tp->p_state],
+#if CH_DBG_FILL_THREADS
+            stack_free(tp));
+#else
+            0UL);
+#endif
     tp = chRegNextThread(tp);
   } while (tp != NULL);
 }
@@ -272,20 +551,326 @@ static void cmd_tree(BaseSequentialStream *chp, int argc, char *argv[]) {
 static void cmd_play(BaseSequentialStream *chp, int argc, char *argv[]) {
 
   (void)argv;
-  if (argc == 0) {
-    chprintf(chp, "Usage: play filename\r\n");
+  if (argc == 0 || argc > 2) {
+    chprintf(chp, "Usage: play filename [ms]\r\n");
     return;
   }
   if (!fs_ready) {
     chprintf(chp, "File System not mounted\r\n");
     return;
   }
-  if (argc == 1){
-      size_t unLen = strlen(argv[0]);
-      if(strcmp(argv[0] + unLen - 4, ".wav") == 0){
-    	playFile(argv[0]);
-      }
+  size_t unLen = strlen(argv[0]);
+  if(strcmp(argv[0] + unLen - 4, ".wav") == 0){
+    playFileAt(argv[0], argc == 2 ? (uint32_t)atol(argv[1]) : 0);
+  }
+}
+
+static void cmd_sound(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const bankSound *s;
+
+  if (argc > 1) {
+    chprintf(chp, "Usage: sound [name]\r\n");
+    return;
+  }
+  if (argc == 1) {
+    if (!playSound(argv[0]))
+      chprintf(chp, "No sound %s in the bank\r\n", argv[0]);
+    return;
+  }
+  for (s = soundBank; s->name; s++)
+    chprintf(chp, "%-16s : %u Hz, %u bits, %lu ms\r\n", s->name, s->sampleRate,
+             s->bitsPerSample, s->frames * 1000 / s->sampleRate);
+}
+
+static void cmd_seek(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  if (argc > 1) {
+    chprintf(chp, "Usage: seek [ms]\r\n");
+    return;
+  }
+  if (!playerThread) {
+    chprintf(chp, "Not playing\r\n");
+    return;
+  }
+  if (argc == 1)
+    seekPlay((uint32_t)atol(argv[0]));
+  else
+    chprintf(chp, "position         : %lu ms%s\r\n", getPlayPosition(),
+             isPaused() ? " (paused)" : "");
+}
+
+static void cmd_pause(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  (void)argv;
+  if (argc > 0) {
+    chprintf(chp, "Usage: pause\r\n");
+    return;
   }
+  pausePlay();
+}
+
+static void cmd_resume(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  (void)argv;
+  if (argc > 0) {
+    chprintf(chp, "Usage: resume\r\n");
+    return;
+  }
+  resumePlay();
+}
+
+static void cmd_queue(BaseSequentialStream *chp, int argc, char *argv[]) {
+  int i;
+
+  if (!fs_ready) {
+    chprintf(chp, "File System not mounted\r\n");
+    return;
+  }
+  for (i = 0; i < argc; i++) {
+    if (!queueFile(argv[i])) {
+      chprintf(chp, "Playlist full, %s not queued\r\n", argv[i]);
+      break;
+    }
+  }
+  chprintf(chp, "queued files     : %u\r\n", (unsigned) getQueueCount());
+}
+
+static void cmd_voice(BaseSequentialStream *chp, int argc, char *argv[]) {
+  int n;
+
+  if (argc > 2 || (argc == 1 && strcmp(argv[0], "stop") == 0)) {
+    chprintf(chp, "Usage: voice [filename [volume]], voice stop n\r\n");
+    return;
+  }
+  if (argc == 2 && strcmp(argv[0], "stop") == 0) {
+    stopVoice(atoi(argv[1]));
+    return;
+  }
+  if (argc > 0) {
+    n = playVoice(argv[0], argc == 2 ? (uint8_t)atoi(argv[1]) : 100);
+    if (n < 0) {
+      chprintf(chp, "Nothing playing or no voice free\r\n");
+      return;
+    }
+    chprintf(chp, "voice            : %d\r\n", n);
+    return;
+  }
+  chprintf(chp, "voices           : %u/%u\r\n", (unsigned) getVoiceCount(), (unsigned) getVoiceMax());
+}
+
+static void cmd_sdbench(BaseSequentialStream *chp, int argc, char *argv[]) {
+  static const uint32_t bounds[] = {250, 500, 1000, 2000, 5000, 10000, 50000, 100000};
+  uint32_t hist[sizeof(bounds) / sizeof(bounds[0]) + 1];
+  uint32_t blocks = 2048, start = 0, n, us, total = 0, min = 0xFFFFFFFF, max = 0;
+  BlockDeviceInfo bdi;
+  unsigned i;
+
+  if (argc > 2) {
+    chprintf(chp, "Usage: sdbench [blocks] [start]\r\n");
+    return;
+  }
+  if (blkGetDriverState(&CARD_DRIVER) != BLK_READY ||
+      blkGetInfo(&CARD_DRIVER, &bdi) != HAL_SUCCESS) {
+    chprintf(chp, "No card\r\n");
+    return;
+  }
+  /* The card driver is not shared with FatFs, the player must be idle.*/
+  if (playerThread) {
+    chprintf(chp, "Stop the player first\r\n");
+    return;
+  }
+  if (argc > 0)
+    blocks = (uint32_t)atol(argv[0]);
+  if (argc > 1)
+    start = (uint32_t)atol(argv[1]);
+  if (start >= bdi.blk_num)
+    start = 0;
+  if (blocks > bdi.blk_num - start)
+    blocks = bdi.blk_num - start;
+
+  memset(hist, 0, sizeof(hist));
+#if CARD_BACKEND == CARD_MMC_SPI
+  if (mmcStartSequentialRead(&MMCD1, start) != HAL_SUCCESS) {
+    chprintf(chp, "Read error at block %lu\r\n", start);
+    return;
+  }
+#endif
+  for (n = 0; n < blocks; n++) {
+    rtcnt_t t = chSysGetRealtimeCounterX();
+#if CARD_BACKEND == CARD_MMC_SPI
+    if (mmcSequentialRead(&MMCD1, blkbuf) != HAL_SUCCESS)
+#else
+    if (blkRead(&CARD_DRIVER, start + n, blkbuf, 1) != HAL_SUCCESS)
+#endif
+      break;
+    us = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - t);
+    total += us;
+    if (us < min)
+      min = us;
+    if (us > max)
+      max = us;
+    for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]) && us >= bounds[i]; i++)
+      ;
+    hist[i]++;
+  }
+#if CARD_BACKEND == CARD_MMC_SPI
+  mmcStopSequentialRead(&MMCD1);
+
+  chprintf(chp, "SPI clock        : %lu kHz (PCLK/%u)\r\n",
+           (STM32_PCLK1 / 1000) >> (spiDiv + 1), 2U << spiDiv);
+#else
+  chprintf(chp, "card bus         : %s\r\n", CARD_NAME);
+#endif
+  if (n < blocks)
+    chprintf(chp, "Read error at block %lu\r\n", start + n);
+  if (!n || !total)
+    return;
+  chprintf(chp, "blocks read      : %lu from %lu\r\n", n, start);
+  chprintf(chp, "throughput       : %lu KB/s\r\n",
+           (uint32_t)((uint64_t)n * MMC_SECTOR_SIZE * 1000000 / 1024 / total));
+  chprintf(chp, "block latency    : min %lu, avg %lu, max %lu us\r\n", min, total / n, max);
+  for (i = 0; i <= sizeof(bounds) / sizeof(bounds[0]); i++) {
+    if (!hist[i])
+      continue;
+    if (i < sizeof(bounds) / sizeof(bounds[0]))
+      chprintf(chp, "  < %6lu us     : %lu\r\n", bounds[i], hist[i]);
+    else
+      chprintf(chp, " >= %6lu us     : %lu\r\n", bounds[i - 1], hist[i]);
+  }
+}
+
+static void cmd_cpu(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint32_t ms = 1000;
+  rtcnt_t t0, t1, i0, i1;
+
+  if (argc > 1) {
+    chprintf(chp, "Usage: cpu [ms]\r\n");
+    return;
+  }
+  if (argc == 1)
+    ms = (uint32_t)atol(argv[0]);
+  /* The counter wraps after 2^32 cycles.*/
+  if (ms < 10 || ms > 10000)
+    ms = 1000;
+  chSysLock();
+  t0 = chSysGetRealtimeCounterX();
+  i0 = idleTotal;
+  chSysUnlock();
+  chThdSleepMilliseconds(ms);
+  chSysLock();
+  t1 = chSysGetRealtimeCounterX();
+  i1 = idleTotal;
+  chSysUnlock();
+  t1 -= t0;
+  i1 -= i0;
+  chprintf(chp, "CPU idle         : %lu.%lu%% over %lu ms\r\n",
+           (uint32_t)((uint64_t)i1 * 100 / t1),
+           (uint32_t)((uint64_t)i1 * 1000 / t1 % 10), ms);
+}
+
+static void cmd_stats(BaseSequentialStream *chp, int argc, char *argv[]) {
+  playerStats st;
+
+  (void)argv;
+  if (argc > 0) {
+    chprintf(chp, "Usage: stats\r\n");
+    return;
+  }
+  getPlayerStats(&st);
+  chprintf(chp, "half period      : %lu us\r\n", st.period);
+  chprintf(chp, "DAC rate         : %lu Hz%s\r\n", st.outRate,
+           getResample() ? "" : " (resampling off)");
+  chprintf(chp, "refills          : %lu\r\n", st.refills);
+  chprintf(chp, "underruns        : %lu\r\n", st.underruns);
+  chprintf(chp, "late refills     : %lu\r\n", st.late);
+  chprintf(chp, "unaligned reads  : %lu\r\n", st.unaligned);
+  chprintf(chp, "max refill time  : %lu us\r\n", st.maxRefill);
+  chprintf(chp, "files played     : %lu (%lu gapless)\r\n", st.tracks, st.gapless);
+  chprintf(chp, "start-up         : open %lu, header %lu, read %lu, DMA %lu us%s\r\n",
+           st.openTime, st.headerTime, st.firstReadTime, st.startTime,
+           getPrefetch() ? " (prefetch)" : "");
+  chprintf(chp, "stop latency     : %lu us\r\n", st.stopTime);
+  chprintf(chp, "mixing           : %lu voices, max %lu us\r\n", st.voices, st.maxMix);
+  chprintf(chp, "voice start      : %lu us\r\n", st.voiceOpenTime);
+  if (st.cacheSize)
+    chprintf(chp, "sample cache     : %lu hits, %lu misses, %lu/%lu bytes\r\n",
+             st.cacheHits, st.cacheMisses, st.cacheUsed, st.cacheSize);
+  if (st.aheadSlots)
+    chprintf(chp, "read-ahead       : %lu slots, low %lu, high %lu, %lu waits, max read %lu us\r\n",
+             st.aheadSlots, st.aheadLow, st.aheadHigh, st.aheadWaits, st.maxCardRead);
+  if (st.clmtSize)
+    chprintf(chp, "link map         : %lu/%lu words%s\r\n", st.clmtUsed, st.clmtSize,
+             st.clmtUsed > st.clmtSize ? " (too small, not used)" : "");
+}
+
+static void cmd_prefetch(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  if (argc > 1 || (argc == 1 && strcmp(argv[0], "on") && strcmp(argv[0], "off"))) {
+    chprintf(chp, "Usage: prefetch [on|off]\r\n");
+    return;
+  }
+  if (argc == 1)
+    setPrefetch(strcmp(argv[0], "on") == 0);
+  chprintf(chp, "prefetch start   : %s\r\n", getPrefetch() ? "on" : "off");
+}
+
+static void cmd_resample(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  if (argc > 1 || (argc == 1 && strcmp(argv[0], "on") && strcmp(argv[0], "off"))) {
+    chprintf(chp, "Usage: resample [on|off]\r\n");
+    return;
+  }
+  if (argc == 1)
+    setResample(strcmp(argv[0], "on") == 0);
+  chprintf(chp, "resampling       : %s\r\n", getResample() ? "on" : "off");
+}
+
+static void cmd_volume(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  if (argc > 1) {
+    chprintf(chp, "Usage: volume [0-100]\r\n");
+    return;
+  }
+  if (argc == 1)
+    setVolume((uint8_t) atoi(argv[0]));
+  chprintf(chp, "volume           : %u%%\r\n", getVolume());
+}
+
+static void cmd_info(BaseSequentialStream *chp, int argc, char *argv[]) {
+  waveInfo wi;
+  unsigned i;
+
+  (void)argv;
+  if (argc > 0) {
+    chprintf(chp, "Usage: info\r\n");
+    return;
+  }
+  getWaveInfo(&wi);
+  if (wi.title[0])
+    chprintf(chp, "title            : %s\r\n", wi.title);
+  chprintf(chp, "format           : 0x%04x, %u ch, %lu Hz, %u bits\r\n",
+           wi.audioFormat, wi.numChannels, wi.sampleRate, wi.bitsPerSample);
+  chprintf(chp, "data             : %lu bytes at %lu\r\n", wi.dataSize, wi.dataOffset);
+  if (wi.factSamples)
+    chprintf(chp, "fact samples     : %lu\r\n", wi.factSamples);
+  if (wi.numCues) {
+    chprintf(chp, "cue points       : %lu", wi.numCues);
+    for (i = 0; i < wi.numCues && i < WAVE_MAX_CUES; i++)
+      chprintf(chp, " %lu", wi.cues[i]);
+    chprintf(chp, "\r\n");
+  }
+}
+
+static void cmd_bufsize(BaseSequentialStream *chp, int argc, char *argv[]) {
+
+  if (argc > 1) {
+    chprintf(chp, "Usage: bufsize [samples]\r\n");
+    return;
+  }
+  if (argc == 1)
+    setHalfSize(atoi(argv[0]));
+  chprintf(chp, "half buffer      : %u samples (max %u)\r\n",
+           getHalfSize(), getHalfSizeMax());
 }
 
 static const ShellCommand commands[] = {
@@ -293,6 +878,20 @@ static const ShellCommand commands[] = {
   {"threads", cmd_threads},
   {"tree", cmd_tree},
   {"play", cmd_play},
+  {"queue", cmd_queue},
+  {"sound", cmd_sound},
+  {"seek", cmd_seek},
+  {"pause", cmd_pause},
+  {"resume", cmd_resume},
+  {"voice", cmd_voice},
+  {"stats", cmd_stats},
+  {"sdbench", cmd_sdbench},
+  {"cpu", cmd_cpu},
+  {"bufsize", cmd_bufsize},
+  {"info", cmd_info},
+  {"prefetch", cmd_prefetch},
+  {"resample", cmd_resample},
+  {"volume", cmd_volume},
   {NULL, NULL}
 };
 
@@ -327,12 +926,24 @@ static void InsertHandler(eventid_t id) {
   /*
    * On insertion MMC initialization and FS mount.
    */
-  if (mmcConnect(&MMCD1)) {
+  if (blkConnect(&CARD_DRIVER)) {
+    tmr_retry();
     return;
   }
+#if CARD_BACKEND == CARD_MMC_SPI
+  mmc_tune_clock();
+#endif
   err = f_mount(&MMC_FS, &path, 1);
+#if CARD_BACKEND == CARD_MMC_SPI
+  /* Slower on disk errors, the probe blocks may have read fine by chance.*/
+  while (err == FR_DISK_ERR && spiDiv < LS_SPI_DIV) {
+    mmc_set_div(spiDiv + 1);
+    err = f_mount(&MMC_FS, &path, 1);
+  }
+#endif
   if (err != FR_OK) {
-    mmcDisconnect(&MMCD1);
+    blkDisconnect(&CARD_DRIVER);
+    tmr_retry();
     return;
   }
   fs_ready = TRUE;
@@ -342,10 +953,23 @@ static void InsertHandler(eventid_t id) {
  * MMC card removal event.
  */
 static void RemoveHandler(eventid_t id) {
+  systime_t start;
 
   (void)id;
-  mmcDisconnect(&MMCD1);
+  /* The player closes its files and waits for its reader, then whatever
+     transfer is still in progress, e.g. from the shell, is let finish or
+     time out before the driver goes from under it.*/
+  if (fileSourceCount() > 0)
+    stopPlay();
+  start = chVTGetSystemTime();
+  while ((blkGetDriverState(&CARD_DRIVER) == BLK_READING ||
+          blkGetDriverState(&CARD_DRIVER) == BLK_WRITING) &&
+         chVTGetSystemTime() - start < MS2ST(CARD_REMOVE_TIMEOUT))
+    chThdSleepMilliseconds(1);
+  blkDisconnect(&CARD_DRIVER);
   fs_ready = FALSE;
+  /* The next card may hold other files under the same paths.*/
+  flushSampleCache();
 }
 
 /*
@@ -382,6 +1006,7 @@ int main(void) {
   palSetPadMode(GPIOA, GPIOA_PIN9, PAL_MODE_ALTERNATE(7));
   palSetPadMode(GPIOA, GPIOA_PIN10, PAL_MODE_ALTERNATE(7));
 #endif
+#if CARD_BACKEND == CARD_MMC_SPI
   /*
    * Initializes the MMC driver to work with SPI2.
    */
@@ -402,11 +1027,20 @@ int main(void) {
 
   mmcObjectInit(&MMCD1);
   mmcStart(&MMCD1, &mmccfg);
+#endif
+#if CARD_BACKEND == CARD_SDC
+  /*
+   * Initializes the SDC driver, D0-D3 on PC8-PC11, CK on PC12, CMD on PD2.
+   */
+  palSetGroupMode(GPIOC, PAL_GROUP_MASK(5), 8, PAL_MODE_STM32_ALTERNATE_PUSHPULL);
+  palSetPadMode(GPIOD, GPIOD_PIN2, PAL_MODE_STM32_ALTERNATE_PUSHPULL);
+  sdcStart(&SDCD1, &sdccfg);
+#endif
 
   /*
    * Activates the card insertion monitor.
    */
-  tmr_init(&MMCD1);
+  tmr_init(&CARD_DRIVER);
 
   /*
    * Creates the blinker thread.
@@ -432,5 +1066,8 @@ int main(void) {
       shelltp = NULL;           /* Triggers spawning of a new shell.        */
     }
     chEvtDispatch(evhndl, chEvtWaitOneTimeout(ALL_EVENTS, MS2ST(500)));
+#if !CARD_DETECT
+    tmr_resume(&CARD_DRIVER);
+#endif
   }
 }
@@ -0,0 +1,316 @@
+/*
+ * bench_conv.c
+ *
+ * Host micro-benchmark of the sample conversion kernels in pcmConv.c
+ * against the original per-sample loop, of the resampler in resample.c
+ * per output sample and of the ADPCM decoder in adpcm.c per decoded
+ * sample. Every kernel is first checked against a plain reference (the
+ * G.711 tables against the ITU-T expansion), or for ADPCM against vectors
+ * produced by an independent IMA encoder and decoder, then timed over a
+ * half buffer sized block.
+ */
+
+#include "ch.h"
+
+#include "pcmConv.h"
+#include "resample.h"
+#include "adpcm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SAMPLES		1024
+#define ROUNDS		20000
+#define RS_IN		44100		// resampler benchmark rates
+#define RS_OUT		50000
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()	__rdtsc()
+#define UNIT		"cycles"
+#else
+#define CYCLES()	sim_ns()
+#define UNIT		"ns"
+
+static uint64_t sim_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+/* The loop pcmConv.c replaces.*/
+static void i16_conv(uint16_t buf[], uint16_t len) {
+	for (uint16_t i=0; i<len; i++) {
+		buf[i] += 0x8000;
+	}
+}
+
+/* IMA ADPCM blocks of three words per channel and their decoded frames,
+   the stereo one runs into both clamps.*/
+static const uint8_t imaMono[] = {
+	0x00, 0x00, 0x14, 0x00, 0x77, 0xf7, 0xff, 0x75, 0xb4, 0xae, 0x31, 0x04,
+	0xca, 0x0a, 0x34, 0xa0
+};
+
+static const int16_t imaMonoOut[] = {
+	0, 93, 292, 722, -203, -2190, -6450, 246, 13618, 30818, 14631, -12698,
+	-31319, -21163, 380, 25563, 28948, 13560, -11623, -28551, -25474, -291,
+	23408, 26485, 12495
+};
+
+static const uint8_t imaStereo[] = {
+	0xff, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x3c, 0x00, 0xff, 0xff, 0xff, 0xff,
+	0x01, 0x01, 0x00, 0x89, 0xff, 0xc6, 0x4c, 0xe3, 0xa9, 0xaa, 0x9a, 0x09,
+	0x69, 0xf0, 0x52, 0xcb, 0x21, 0x54, 0x33, 0x24
+};
+
+static const int16_t imaStereoOut[] = {
+	32767, 0, 32756, 852, 32726, 1110, 32663, 1813, 32527, 2026, 32234, 2220,
+	31603, 2396, 30246, 1916, 27336, 1771, 21100, 1374, 7728, 773, 32572, 226,
+	2101, -271, -32768, -723, 4094, -969, 32763, -1192, -15652, -1124, -27938, -940,
+	20477, -660, 24572, -201, -31291, 477, -10813, 1110, 30153, 1685, 1484, 2357,
+	-32034, 2809
+};
+
+static uint32_t in[SAMPLES];
+static uint32_t work[SAMPLES];
+static uint16_t ref[SAMPLES * 2];
+static volatile uint32_t sink;
+
+static void report(const char *name, uint64_t cycles) {
+	printf("%-24s %8.3f %s/sample\n", name, (double) cycles / ((double) ROUNDS * SAMPLES), UNIT);
+}
+
+/*
+ * Resampler reference: absolute 64-bit position per output frame.
+ */
+static int check_resample(uint8_t channels) {
+	const uint16_t *x = (const uint16_t *) in;
+	uint16_t *out = (uint16_t *) work;
+	resampler rs;
+	uint64_t step = ((uint64_t) RS_IN << 32) / RS_OUT, pos;
+	size_t blocks[3] = {100, SAMPLES / 2 - 100, 7};
+	size_t b, j, n = 0, used = 0;
+	uint8_t c;
+
+	resample_init(&rs, RS_IN, RS_OUT, 0x8000);
+	for (b = 0; b < 3; b++) {
+		size_t k = resample_input(&rs, blocks[b]);
+		resample_u16(&rs, x + used * channels, out + n * channels, blocks[b], channels);
+		n += blocks[b];
+		used += k;
+	}
+	for (j = 0, pos = 0; j < n; j++, pos += step) {
+		// frame i of the input sits at position i + 2, mid-scale before
+		int64_t i = (int64_t) (pos >> 32) - 2;
+		int32_t w = (int32_t) ((uint32_t) pos >> 17);
+		for (c = 0; c < channels; c++) {
+			int32_t h0 = i < 0 ? 0x8000 : x[i * channels + c];
+			int32_t h1 = i + 1 < 0 ? 0x8000 : x[(i + 1) * channels + c];
+			if (out[j * channels + c] != (uint16_t) (h0 + (((h1 - h0) * w) >> 15)))
+				return 1;
+		}
+	}
+	return used != (size_t) (pos >> 32);
+}
+
+/*
+ * G.711 expansion as the ITU-T reference code computes it.
+ */
+static int16_t ulaw_ref(uint8_t u) {
+	int32_t t;
+
+	u = (uint8_t) ~u;
+	t = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4);
+	return (int16_t) ((u & 0x80) ? 0x84 - t : t - 0x84);
+}
+
+static int16_t alaw_ref(uint8_t a) {
+	int32_t t, seg;
+
+	a ^= 0x55;
+	t = (a & 0x0F) << 4;
+	seg = (a & 0x70) >> 4;
+	if (seg == 0)
+		t += 8;
+	else
+		t = (t + 0x108) << (seg - 1);
+	return (int16_t) ((a & 0x80) ? t : -t);
+}
+
+/*
+ * Both tables, then an in place expansion from the second half.
+ */
+static int check_g711(void) {
+	uint16_t buf[SAMPLES];
+	uint8_t *codes = (uint8_t *) buf + SAMPLES;
+	size_t i;
+
+	for (i = 0; i < 256; i++) {
+		if (pcm_ulaw_table[i] != (uint16_t) (ulaw_ref((uint8_t) i) ^ 0x8000)
+			|| pcm_alaw_table[i] != (uint16_t) (alaw_ref((uint8_t) i) ^ 0x8000))
+			return 1;
+	}
+	memcpy(codes, in, SAMPLES - 1);
+	pcm_g711_to_u16(codes, buf, SAMPLES - 1, pcm_ulaw_table);
+	for (i = 0; i < SAMPLES - 1; i++)
+		if (buf[i] != pcm_ulaw_table[((uint8_t *) in)[i]])
+			return 1;
+	return 0;
+}
+
+/*
+ * Decodes a vector block in uneven pieces, so that codes are picked up
+ * in the middle of bytes and words.
+ */
+static int check_adpcm(const uint8_t *blk, size_t size, const int16_t *ref, uint8_t channels) {
+	static const size_t pieces[] = {1, 4, 3, 9, 100};
+	int16_t out[64];
+	adpcm_ima st;
+	size_t i, n = 0, frames;
+
+	adpcm_ima_init(&st, channels);
+	frames = adpcm_ima_block(&st, blk, size);
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+		n += adpcm_ima_decode(&st, out + n * channels, pieces[i]);
+	return n != frames || frames != 25 || adpcm_ima_decode(&st, out, 1) != 0
+		|| memcmp(out, ref, frames * channels * sizeof(int16_t)) != 0;
+}
+
+int main(void) {
+	uint8_t *in8 = (uint8_t *) in;
+	uint64_t t;
+	size_t i;
+	int r, fail = 0;
+
+	srand(1);
+	for (i = 0; i < sizeof(in); i++)
+		in8[i] = (uint8_t) rand();
+
+	/* Bit-exactness against plain references.*/
+	memcpy(work, in, SAMPLES * 2);
+	pcm_s16_to_u16((uint16_t *) work, SAMPLES - 1);
+	for (i = 0; i < SAMPLES - 1; i++)
+		fail |= ((uint16_t *) work)[i] != (uint16_t) (((uint16_t *) in)[i] + 0x8000);
+	for (i = 0; i < SAMPLES; i++)
+		ref[i] = (uint16_t) (in8[3*i+1] | (in8[3*i+2] << 8)) ^ 0x8000;
+	memcpy(work, in, SAMPLES * 3);
+	pcm_s24_to_u16((uint8_t *) work, (uint16_t *) work, SAMPLES - 1);
+	fail |= memcmp(work, ref, (SAMPLES - 1) * 2) != 0;
+	for (i = 0; i < SAMPLES; i++)
+		ref[i] = (uint16_t) (in[i] >> 16) ^ 0x8000;
+	memcpy(work, in, SAMPLES * 4);
+	pcm_s32_to_u16((uint8_t *) work, (uint16_t *) work, SAMPLES - 1);
+	fail |= memcmp(work, ref, (SAMPLES - 1) * 2) != 0;
+	fail |= check_resample(1);
+	fail |= check_resample(2);
+	fail |= check_g711();
+	fail |= check_adpcm(imaMono, sizeof(imaMono), imaMonoOut, 1);
+	fail |= check_adpcm(imaStereo, sizeof(imaStereo), imaStereoOut, 2);
+	if (fail) {
+		printf("kernel output mismatch\n");
+		return 1;
+	}
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		i16_conv((uint16_t *) work, SAMPLES);
+		sink += work[r & (SAMPLES - 1)];
+	}
+	report("i16_conv (original)", CYCLES() - t);
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		pcm_s16_to_u16((uint16_t *) work, SAMPLES);
+		sink += work[r & (SAMPLES - 1)];
+	}
+	report("pcm_s16_to_u16", CYCLES() - t);
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		pcm_s24_to_u16((uint8_t *) in, (uint16_t *) work, SAMPLES);
+		sink += work[r & (SAMPLES / 2 - 1)];
+	}
+	report("pcm_s24_to_u16", CYCLES() - t);
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		pcm_s32_to_u16((uint8_t *) in, (uint16_t *) work, SAMPLES);
+		sink += work[r & (SAMPLES / 2 - 1)];
+	}
+	report("pcm_s32_to_u16", CYCLES() - t);
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		pcm_u8_copy((uint8_t *) in, (uint8_t *) work, SAMPLES);
+		sink += work[r & (SAMPLES / 4 - 1)];
+	}
+	report("pcm_u8_copy", CYCLES() - t);
+
+	t = CYCLES();
+	for (r = 0; r < ROUNDS; r++) {
+		pcm_g711_to_u16((uint8_t *) in, (uint16_t *) work, SAMPLES, pcm_alaw_table);
+		sink += work[r & (SAMPLES / 2 - 1)];
+	}
+	report("pcm_g711_to_u16", CYCLES() - t);
+
+	/* Per output frame, the input is consumed at RS_IN/RS_OUT.*/
+	{
+		resampler rs;
+
+		resample_init(&rs, RS_IN, RS_OUT, 0x8000);
+		t = CYCLES();
+		for (r = 0; r < ROUNDS; r++) {
+			rs.frac = 0;
+			resample_u16(&rs, (uint16_t *) in, (uint16_t *) work, SAMPLES, 1);
+			sink += work[r & (SAMPLES / 2 - 1)];
+		}
+		report("resample_u16 mono", CYCLES() - t);
+
+		t = CYCLES();
+		for (r = 0; r < ROUNDS; r++) {
+			rs.frac = 0;
+			resample_u16(&rs, (uint16_t *) in, (uint16_t *) work, SAMPLES / 2, 2);
+			sink += work[r & (SAMPLES / 2 - 1)];
+		}
+		report("resample_u16 stereo", CYCLES() - t);
+
+		resample_init(&rs, RS_IN, RS_OUT, 0x80);
+		t = CYCLES();
+		for (r = 0; r < ROUNDS; r++) {
+			rs.frac = 0;
+			resample_u8(&rs, (uint8_t *) in, (uint8_t *) work, SAMPLES, 1);
+			sink += work[r & (SAMPLES / 4 - 1)];
+		}
+		report("resample_u8 mono", CYCLES() - t);
+	}
+
+	/* Per decoded sample, SAMPLES of them out of a block of random codes.*/
+	{
+		adpcm_ima st;
+		size_t mono = 4 + SAMPLES / 2, stereo = 8 + SAMPLES / 2;
+
+		adpcm_ima_init(&st, 1);
+		t = CYCLES();
+		for (r = 0; r < ROUNDS; r++) {
+			adpcm_ima_block(&st, in8, mono);
+			adpcm_ima_decode(&st, (int16_t *) work, SAMPLES);
+			sink += work[r & (SAMPLES / 2 - 1)];
+		}
+		report("adpcm_ima_decode mono", CYCLES() - t);
+
+		adpcm_ima_init(&st, 2);
+		t = CYCLES();
+		for (r = 0; r < ROUNDS; r++) {
+			adpcm_ima_block(&st, in8, stereo);
+			adpcm_ima_decode(&st, (int16_t *) work, SAMPLES / 2);
+			sink += work[r & (SAMPLES / 2 - 1)];
+		}
+		report("adpcm_ima_decode stereo", CYCLES() - t);
+	}
+
+	return 0;
+}
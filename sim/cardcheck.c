@@ -0,0 +1,23 @@
+/*
+ * cardcheck.c
+ *
+ * Compiles the FatFs binding of the firmware, cardDiskio.c, for the card
+ * backend card.h picks from the HAL_USE_* settings given on the command
+ * line, and checks that it picks CARD_EXPECT. Built, not linked, by
+ * 'make cards' once per backend so the board builds do not have to be
+ * the first to find a break in one of them.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "card.h"
+
+#if !defined(CARD_EXPECT)
+#error "CARD_EXPECT not defined"
+#endif
+
+#if CARD_BACKEND != CARD_EXPECT
+#error "card.h picked the wrong backend"
+#endif
+
+#include "../cardDiskio.c"
@@ -0,0 +1,164 @@
+/*
+ * ch.h
+ *
+ * Host stand-in for the subset of the ChibiOS/RT 3.x API used by the
+ * player. Threads are POSIX threads, the kernel lock is a single global
+ * mutex and every thread owns a condition variable used for its event
+ * flags, so the player code compiles and runs unmodified on Linux.
+ */
+
+#ifndef _CH_H_
+#define _CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef TRUE
+#define TRUE					1
+#endif
+#ifndef FALSE
+#define FALSE					0
+#endif
+
+typedef uint32_t	systime_t;
+typedef uint32_t	rtcnt_t;
+typedef uint32_t	eventmask_t;
+typedef uint32_t	eventid_t;
+typedef uint32_t	tprio_t;
+typedef int32_t		msg_t;
+typedef int32_t		cnt_t;
+typedef uint64_t	stkalign_t;
+
+#define CH_CFG_ST_FREQUENCY		1000
+#define CH_CFG_USE_HEAP			TRUE
+
+#define IDLEPRIO				1
+#define LOWPRIO					2
+#define NORMALPRIO				64
+#define HIGHPRIO				255
+
+#define MSG_OK					((msg_t)0)
+#define MSG_TIMEOUT				((msg_t)-1)
+#define MSG_RESET				((msg_t)-2)
+
+#define TIME_IMMEDIATE			((systime_t)0)
+#define TIME_INFINITE			((systime_t)-1)
+
+#define ALL_EVENTS				((eventmask_t)-1)
+#define EVENT_MASK(eid)			((eventmask_t)1 << (eventmask_t)(eid))
+
+#define S2ST(sec)				((systime_t)((uint32_t)(sec) * (uint32_t)CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)				((systime_t)((((uint32_t)(msec)) * ((uint32_t)CH_CFG_ST_FREQUENCY) + 999UL) / 1000UL))
+#define US2ST(usec)				((systime_t)((((uint32_t)(usec)) * ((uint32_t)CH_CFG_ST_FREQUENCY) + 999999UL) / 1000000UL))
+#define ST2MS(n)				((uint32_t)(((uint32_t)(n) * 1000UL) / (uint32_t)CH_CFG_ST_FREQUENCY))
+
+/* The realtime counter runs at 1 GHz, i.e. it counts nanoseconds.*/
+#define SIM_RTC_FREQUENCY		1000000000UL
+#define RTC2US(freq, n)			((uint32_t)((n) / ((freq) / 1000000UL)))
+#define US2RTC(freq, usec)		((rtcnt_t)((usec) * ((freq) / 1000000UL)))
+
+typedef void (*tfunc_t)(void *);
+
+typedef struct ch_thread {
+	pthread_t		tid;
+	pthread_cond_t	cond;		/* Signalled on any state change.*/
+	const char		*name;
+	tprio_t			prio;
+	eventmask_t		epending;
+	bool			terminate;
+	bool			exited;
+	msg_t			exitcode;
+	tfunc_t			pf;
+	void			*arg;
+	msg_t			rdymsg;		/* Message from chThdResumeI().*/
+} thread_t;
+
+typedef thread_t	*thread_reference_t;
+
+/* Semaphores wait on a condition variable of their own.*/
+typedef struct ch_semaphore {
+	cnt_t			cnt;
+	pthread_cond_t	cond;
+} semaphore_t;
+
+/* Mailboxes only have the non-blocking I-class API on the host.*/
+typedef struct ch_mailbox {
+	msg_t			*buffer;
+	cnt_t			size;
+	cnt_t			rd;
+	cnt_t			cnt;
+} mailbox_t;
+
+#define MAILBOX_DECL(name, buffer, size)	mailbox_t name = {(msg_t *)(buffer), (size), 0, 0}
+#define chMBGetUsedCountI(mbp)				((mbp)->cnt)
+#define chMBGetFreeCountI(mbp)				((mbp)->size - (mbp)->cnt)
+
+/* Heaps only keep count of their size on the host, the blocks come from
+   malloc() and are charged with their header as in the kernel allocator.*/
+typedef struct memory_heap {
+	size_t			size;
+	size_t			used;
+} memory_heap_t;
+
+/* The working area only has to hold the thread descriptor on the host.*/
+#define THD_WORKING_AREA_SIZE(n)	(sizeof(thread_t) + (n))
+#define THD_WORKING_AREA(s, n)		thread_t s[1 + (n) / sizeof(thread_t)]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void chSysInit(void);
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromISR(void);
+void chSysUnlockFromISR(void);
+rtcnt_t chSysGetRealtimeCounterX(void);
+
+systime_t chVTGetSystemTimeX(void);
+systime_t chVTGetSystemTime(void);
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+thread_t *chThdCreateI(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+void chSchWakeupS(thread_t *ntp, msg_t msg);
+thread_t *chThdGetSelfX(void);
+void chThdExit(msg_t msg);
+void chThdExitS(msg_t msg);
+msg_t chThdWait(thread_t *tp);
+void chThdTerminate(thread_t *tp);
+bool chThdShouldTerminateX(void);
+bool chThdTerminatedX(thread_t *tp);
+void chThdSleep(systime_t time);
+void chThdSleepMilliseconds(uint32_t msec);
+void chThdSleepMicroseconds(uint32_t usec);
+void chRegSetThreadName(const char *name);
+msg_t chThdSuspendS(thread_reference_t *trp);
+void chThdResumeI(thread_reference_t *trp, msg_t msg);
+
+void chSemObjectInit(semaphore_t *sp, cnt_t n);
+void chSemReset(semaphore_t *sp, cnt_t n);
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time);
+void chSemSignal(semaphore_t *sp);
+
+void chEvtSignal(thread_t *tp, eventmask_t events);
+void chEvtSignalI(thread_t *tp, eventmask_t events);
+eventmask_t chEvtWaitAny(eventmask_t events);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time);
+eventmask_t chEvtGetAndClearEvents(eventmask_t events);
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, cnt_t n);
+void chMBResetI(mailbox_t *mbp);
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg);
+msg_t chMBFetchI(mailbox_t *mbp, msg_t *msgp);
+
+void chHeapObjectInit(memory_heap_t *heapp, void *buf, size_t size);
+void *chHeapAlloc(memory_heap_t *heapp, size_t size);
+void chHeapFree(void *p);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _CH_H_ */
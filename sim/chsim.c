@@ -0,0 +1,408 @@
+/*
+ * chsim.c
+ *
+ * POSIX implementation of the kernel stand-in declared in ch.h, and of the
+ * channel read of hal.h.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "sim.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t sysmtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread thread_t *self;
+static thread_t mainthread;
+static uint64_t t0;
+
+sim_wait_hook_t sim_wait_hook;
+
+uint64_t sim_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t sim_thread_cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void sim_sys_wait(pthread_cond_t *cond) {
+	pthread_cond_wait(cond, &sysmtx);
+}
+
+bool sim_sys_timedwait(pthread_cond_t *cond, uint64_t deadline_ns) {
+	struct timespec ts;
+	ts.tv_sec = deadline_ns / 1000000000ULL;
+	ts.tv_nsec = deadline_ns % 1000000000ULL;
+	return pthread_cond_timedwait(cond, &sysmtx, &ts) != ETIMEDOUT;
+}
+
+static void thread_init(thread_t *tp, tprio_t prio, tfunc_t pf, void *arg) {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tp->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	tp->name = NULL;
+	tp->prio = prio;
+	tp->epending = 0;
+	tp->terminate = false;
+	tp->exited = false;
+	tp->exitcode = MSG_OK;
+	tp->pf = pf;
+	tp->arg = arg;
+}
+
+void chSysInit(void) {
+	t0 = sim_now_ns();
+	thread_init(&mainthread, NORMALPRIO, NULL, NULL);
+	mainthread.tid = pthread_self();
+	mainthread.name = "main";
+	self = &mainthread;
+}
+
+void chSysLock(void) {
+	pthread_mutex_lock(&sysmtx);
+}
+
+void chSysUnlock(void) {
+	pthread_mutex_unlock(&sysmtx);
+}
+
+void chSysLockFromISR(void) {
+	pthread_mutex_lock(&sysmtx);
+}
+
+void chSysUnlockFromISR(void) {
+	pthread_mutex_unlock(&sysmtx);
+}
+
+rtcnt_t chSysGetRealtimeCounterX(void) {
+	return (rtcnt_t) sim_now_ns();
+}
+
+systime_t chVTGetSystemTimeX(void) {
+	return (systime_t) ((sim_now_ns() - t0) / (1000000000ULL / CH_CFG_ST_FREQUENCY));
+}
+
+systime_t chVTGetSystemTime(void) {
+	return chVTGetSystemTimeX();
+}
+
+static void *thread_entry(void *p) {
+	thread_t *tp = p;
+
+	self = tp;
+	tp->pf(tp->arg);
+	chThdExit(MSG_OK);
+	return NULL;
+}
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+	thread_t *tp = wsp;
+
+	(void) size;
+	thread_init(tp, prio, pf, arg);
+	if (pthread_create(&tp->tid, NULL, thread_entry, tp) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	return tp;
+}
+
+/* Created suspended, chSchWakeupS() starts it. The host thread runs as
+   soon as it is created but cannot take the lock before the caller
+   releases it.*/
+thread_t *chThdCreateI(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+	thread_t *tp = wsp;
+
+	(void) size;
+	thread_init(tp, prio, pf, arg);
+	return tp;
+}
+
+void chSchWakeupS(thread_t *ntp, msg_t msg) {
+	(void) msg;
+	if (pthread_create(&ntp->tid, NULL, thread_entry, ntp) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
+
+thread_t *chThdGetSelfX(void) {
+	return self;
+}
+
+void chThdExit(msg_t msg) {
+	chSysLock();
+	chThdExitS(msg);
+}
+
+void chThdExitS(msg_t msg) {
+	self->exitcode = msg;
+	self->exited = true;
+	pthread_cond_broadcast(&self->cond);
+	chSysUnlock();
+	pthread_exit(NULL);
+}
+
+msg_t chThdWait(thread_t *tp) {
+	chSysLock();
+	while (!tp->exited)
+		sim_sys_wait(&tp->cond);
+	chSysUnlock();
+	pthread_join(tp->tid, NULL);
+	return tp->exitcode;
+}
+
+void chThdTerminate(thread_t *tp) {
+	chSysLock();
+	tp->terminate = true;
+	chSysUnlock();
+}
+
+bool chThdShouldTerminateX(void) {
+	return self->terminate;
+}
+
+bool chThdTerminatedX(thread_t *tp) {
+	return tp->exited;
+}
+
+void chThdSleep(systime_t time) {
+	struct timespec ts;
+	uint64_t ns = (uint64_t) time * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+void chThdSleepMilliseconds(uint32_t msec) {
+	chThdSleep(MS2ST(msec));
+}
+
+void chThdSleepMicroseconds(uint32_t usec) {
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000UL;
+	ts.tv_nsec = (usec % 1000000UL) * 1000UL;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+void chRegSetThreadName(const char *name) {
+	self->name = name;
+}
+
+/* Suspended threads do not count as waiting for events, the virtual DAC
+   does not see them.*/
+msg_t chThdSuspendS(thread_reference_t *trp) {
+	thread_t *tp = self;
+
+	*trp = tp;
+	while (*trp == tp)
+		sim_sys_wait(&tp->cond);
+	return tp->rdymsg;
+}
+
+void chThdResumeI(thread_reference_t *trp, msg_t msg) {
+	thread_t *tp = *trp;
+
+	if (tp) {
+		*trp = NULL;
+		tp->rdymsg = msg;
+		pthread_cond_broadcast(&tp->cond);
+	}
+}
+
+void chSemObjectInit(semaphore_t *sp, cnt_t n) {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sp->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	sp->cnt = n;
+}
+
+void chSemReset(semaphore_t *sp, cnt_t n) {
+	chSysLock();
+	sp->cnt = n;
+	pthread_cond_broadcast(&sp->cond);
+	chSysUnlock();
+}
+
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time) {
+	uint64_t deadline = sim_now_ns() + (uint64_t) time * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+	msg_t msg = MSG_OK;
+
+	chSysLock();
+	while (sp->cnt <= 0) {
+		if (time == TIME_INFINITE)
+			sim_sys_wait(&sp->cond);
+		else if (time == TIME_IMMEDIATE || !sim_sys_timedwait(&sp->cond, deadline)) {
+			msg = MSG_TIMEOUT;
+			break;
+		}
+	}
+	if (msg == MSG_OK)
+		sp->cnt--;
+	chSysUnlock();
+	return msg;
+}
+
+void chSemSignal(semaphore_t *sp) {
+	chSysLock();
+	sp->cnt++;
+	pthread_cond_signal(&sp->cond);
+	chSysUnlock();
+}
+
+void chEvtSignalI(thread_t *tp, eventmask_t events) {
+	tp->epending |= events;
+	pthread_cond_broadcast(&tp->cond);
+}
+
+void chEvtSignal(thread_t *tp, eventmask_t events) {
+	chSysLock();
+	chEvtSignalI(tp, events);
+	chSysUnlock();
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time) {
+	eventmask_t m;
+	uint64_t deadline = 0;
+
+	if (time != TIME_INFINITE)
+		deadline = sim_now_ns() + (uint64_t) time * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+
+	chSysLock();
+	if (sim_wait_hook)
+		sim_wait_hook(self, true);
+	while (!(self->epending & events)) {
+		if (time == TIME_INFINITE)
+			sim_sys_wait(&self->cond);
+		else if (time == TIME_IMMEDIATE || !sim_sys_timedwait(&self->cond, deadline))
+			break;
+	}
+	m = self->epending & events;
+	self->epending &= ~m;
+	if (sim_wait_hook)
+		sim_wait_hook(self, false);
+	chSysUnlock();
+	return m;
+}
+
+eventmask_t chEvtWaitAny(eventmask_t events) {
+	return chEvtWaitAnyTimeout(events, TIME_INFINITE);
+}
+
+eventmask_t chEvtGetAndClearEvents(eventmask_t events) {
+	eventmask_t m;
+
+	chSysLock();
+	m = self->epending & events;
+	self->epending &= ~m;
+	chSysUnlock();
+	return m;
+}
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, cnt_t n) {
+	mbp->buffer = buf;
+	mbp->size = n;
+	mbp->rd = 0;
+	mbp->cnt = 0;
+}
+
+void chMBResetI(mailbox_t *mbp) {
+	mbp->rd = 0;
+	mbp->cnt = 0;
+}
+
+msg_t chMBPostI(mailbox_t *mbp, msg_t msg) {
+	if (mbp->cnt == mbp->size)
+		return MSG_TIMEOUT;
+	mbp->buffer[(mbp->rd + mbp->cnt) % mbp->size] = msg;
+	mbp->cnt++;
+	return MSG_OK;
+}
+
+msg_t chMBFetchI(mailbox_t *mbp, msg_t *msgp) {
+	if (mbp->cnt == 0)
+		return MSG_TIMEOUT;
+	*msgp = mbp->buffer[mbp->rd];
+	mbp->rd = (mbp->rd + 1) % mbp->size;
+	mbp->cnt--;
+	return MSG_OK;
+}
+
+typedef union {
+	struct {
+		memory_heap_t	*heap;
+		size_t			size;
+	} h;
+	stkalign_t		align;
+} heap_header;
+
+void chHeapObjectInit(memory_heap_t *heapp, void *buf, size_t size) {
+	(void) buf;
+	heapp->size = size;
+	heapp->used = 0;
+}
+
+void *chHeapAlloc(memory_heap_t *heapp, size_t size) {
+	heap_header *hp;
+
+	size = (size + sizeof(stkalign_t) - 1) & ~(sizeof(stkalign_t) - 1);
+	chSysLock();
+	if (heapp->used + sizeof(heap_header) + size > heapp->size) {
+		chSysUnlock();
+		return NULL;
+	}
+	heapp->used += sizeof(heap_header) + size;
+	chSysUnlock();
+	hp = malloc(sizeof(heap_header) + size);
+	hp->h.heap = heapp;
+	hp->h.size = size;
+	return hp + 1;
+}
+
+void chHeapFree(void *p) {
+	heap_header *hp = (heap_header *) p - 1;
+
+	chSysLock();
+	hp->h.heap->used -= sizeof(heap_header) + hp->h.size;
+	chSysUnlock();
+	free(hp);
+}
+
+size_t chnReadTimeout(BaseChannel *chp, uint8_t *bp, size_t n, systime_t time) {
+	struct pollfd pfd = {chp->fd, POLLIN, 0};
+	uint64_t deadline = sim_now_ns() + (uint64_t) time * (1000000000ULL / CH_CFG_ST_FREQUENCY);
+	size_t done = 0;
+
+	while (done < n) {
+		int64_t left = (int64_t) (deadline - sim_now_ns());
+		ssize_t r;
+
+		if (time != TIME_INFINITE) {
+			if (left <= 0 || poll(&pfd, 1, (int) ((left + 999999) / 1000000)) <= 0)
+				break;
+		}
+		r = read(chp->fd, bp + done, n - done);
+		if (r <= 0)
+			break;
+		done += (size_t) r;
+	}
+	return done;
+}
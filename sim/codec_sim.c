@@ -0,0 +1,201 @@
+/*
+ * codec_sim.c
+ *
+ * Virtual DAC: replaces codec_DAC.c on the host. A helper thread plays the
+ * circular DMA buffer at the virtual sample rate, appends every completed
+ * half to an optional sink file and signals EVT_DAC_TC to the player the
+ * the same way daccb() does on the target.
+ *
+ * With speed > 0 the half buffer period is scaled by 1/speed in wall time.
+ * With speed == 0 the virtual DAC runs in lock-step with the player: the
+ * next half completes as soon as the previous refill is done, which makes
+ * runs deterministic and as fast as the host allows.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "sim.h"
+
+#include "codec_DAC.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static thread_t *consumer;		// thread that started the DMA, i.e. the player
+static pthread_t dactid;
+static pthread_cond_t daccond;
+static bool running;
+static bool paused;				// no triggers, the DMA holds its position
+static bool pending;			// refill requested and not yet completed
+static uint64_t signalTime;
+static uint64_t cpuStart;
+static uint32_t halfCount;
+static uint8_t lastHalf;
+
+static uint8_t *dmabuf;
+static size_t dmalen;			// number of transfers in the whole buffer
+static size_t sampleBytes;		// bytes per transfer, i.e. per frame
+static uint32_t rate;
+
+static double simSpeed;
+static double simCpuScale = 1.0;
+static FILE *sink;
+static sim_dac_stats_t stats;
+
+static void wait_hook(thread_t *tp, bool enter) {
+	if (tp != consumer || !running)
+		return;
+
+	if (!enter) {
+		cpuStart = sim_thread_cpu_ns();
+		return;
+	}
+
+	if (pending) {
+		uint32_t latency = (uint32_t) (sim_now_ns() - signalTime);
+		uint32_t cpu = (uint32_t) (sim_thread_cpu_ns() - cpuStart);
+
+		stats.refills++;
+		stats.latencySum += latency;
+		if (latency > stats.latencyMax)
+			stats.latencyMax = latency;
+		stats.cpuSum += cpu;
+		if (cpu > stats.cpuMax)
+			stats.cpuMax = cpu;
+		if (cpu * simCpuScale > stats.periodNs)
+			stats.overbudget++;
+		pending = false;
+		pthread_cond_broadcast(&daccond);
+	}
+}
+
+static void *dac_thread(void *arg) {
+	uint64_t deadline = sim_now_ns();
+	size_t half = 0;
+
+	(void) arg;
+	chSysLock();
+	while (running) {
+		/* The virtual DMA only holds at half boundaries.*/
+		while (running && paused) {
+			sim_sys_wait(&daccond);
+			deadline = sim_now_ns();
+		}
+		if (simSpeed > 0) {
+			deadline += (uint64_t) (stats.periodNs / simSpeed);
+			while (running && sim_sys_timedwait(&daccond, deadline))
+				;
+		} else {
+			while (running && pending)
+				sim_sys_wait(&daccond);
+		}
+		if (!running)
+			break;
+
+		/* The DMA has reached the end of a half: if its refill is still in
+		   progress the player lost the race and the output glitches.*/
+		if (pending)
+			stats.underruns++;
+
+		if (sink)
+			fwrite(dmabuf + half * (dmalen / 2) * sampleBytes, sampleBytes, dmalen / 2, sink);
+		stats.samples += dmalen / 2;
+		lastHalf = (uint8_t) half;
+		halfCount++;
+		half ^= 1;
+
+		pending = true;
+		signalTime = sim_now_ns();
+		chEvtSignalI(consumer, EVT_DAC_TC);
+	}
+	chSysUnlock();
+	return NULL;
+}
+
+void sim_dac_setup(double speed, double cpuScale, const char *sinkPath) {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&daccond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	simSpeed = speed;
+	simCpuScale = cpuScale;
+	if (sinkPath) {
+		sink = fopen(sinkPath, "wb");
+		if (!sink)
+			perror(sinkPath);
+	}
+	sim_wait_hook = wait_hook;
+}
+
+void sim_dac_get_stats(sim_dac_stats_t *s) {
+	chSysLock();
+	*s = stats;
+	chSysUnlock();
+	if (sink)
+		fflush(sink);
+}
+
+void codec_init(uint8_t numBits, uint8_t numChannels) {
+	sampleBytes = ((numBits == 16) ? sizeof(dacsample_t) : 1) * numChannels;
+}
+
+void codec_stop(void) {
+	chSysLock();
+	if (!running) {
+		chSysUnlock();
+		return;
+	}
+	running = false;
+	pthread_cond_broadcast(&daccond);
+	chSysUnlock();
+	pthread_join(dactid, NULL);
+}
+
+// Send data to codec
+void codec_audio_send(uint32_t sampleRate, dacsample_t *txbuf, size_t n) {
+	chSysLock();
+	/* The player may reach this before playFile() has published
+	   playerThread, so the target of the events is taken from here.*/
+	consumer = chThdGetSelfX();
+	dmabuf = (uint8_t *) txbuf;
+	dmalen = n;
+	rate = sampleRate;
+	/* The timer period is rounded as in codec_DAC.c.*/
+	stats.periodNs = (uint32_t) ((uint64_t) (n / 2) * 1000000000ULL
+		* ((CODEC_TIMER_FREQ + rate / 2) / rate) / CODEC_TIMER_FREQ);
+	pending = false;
+	halfCount = 0;
+	lastHalf = 1;
+	paused = false;
+	running = true;
+	chSysUnlock();
+	pthread_create(&dactid, NULL, dac_thread, NULL);
+}
+
+void codec_pause(void) {
+	chSysLock();
+	paused = true;
+	chSysUnlock();
+}
+
+void codec_resume(void) {
+	chSysLock();
+	paused = false;
+	pthread_cond_broadcast(&daccond);
+	chSysUnlock();
+}
+
+uint32_t codec_half_count(uint8_t *half) {
+	uint32_t cnt;
+
+	chSysLock();
+	cnt = halfCount;
+	if (half)
+		*half = lastHalf;
+	chSysUnlock();
+	return cnt;
+}
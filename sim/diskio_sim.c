@@ -0,0 +1,136 @@
+/*
+ * diskio_sim.c
+ *
+ * The host block device HBD1 over a FAT formatted disk image file, the
+ * card FatFs reads through the binding of the firmware (cardDiskio.c).
+ * An optional per-command plus per-sector delay emulates the MMC/SPI
+ * link so refill timing in the simulation is in the right ballpark, and
+ * a periodic stall the pauses of a card busy erasing blocks.
+ */
+
+#include "ch.h"
+#include "sim.h"
+
+#include "hal.h"
+#include "ff.h"
+#include "card.h"
+
+#include <stdio.h>
+
+HostBlockDevice HBD1;
+
+static FILE *image;
+static uint32_t latency;		// us per sector
+static uint32_t ncommands;
+static uint32_t nsectors;
+static uint32_t stallMs;
+static uint32_t stallEvery;		// read commands
+static uint32_t nstalls;
+
+int sim_disk_open(const char *imagePath, uint32_t latencyUs) {
+	image = fopen(imagePath, "rb");
+	if (!image) {
+		perror(imagePath);
+		return -1;
+	}
+	latency = latencyUs;
+	return blkConnect(&HBD1) == HAL_SUCCESS ? 0 : -1;
+}
+
+void sim_disk_stall(uint32_t ms, uint32_t every) {
+	stallMs = ms;
+	stallEvery = every;
+}
+
+void sim_disk_close(void) {
+	blkDisconnect(&HBD1);
+	if (image)
+		fclose(image);
+	image = NULL;
+}
+
+void sim_disk_get_stats(uint32_t *commands, uint32_t *sectors, uint32_t *stalls) {
+	*commands = ncommands;
+	*sectors = nsectors;
+	*stalls = nstalls;
+}
+
+bool blkIsInserted(HostBlockDevice *bdp) {
+	(void) bdp;
+	return image != NULL;
+}
+
+bool blkIsWriteProtected(HostBlockDevice *bdp) {
+	(void) bdp;
+	return TRUE;
+}
+
+bool blkConnect(HostBlockDevice *bdp) {
+	if (!image)
+		return HAL_FAILED;
+	bdp->state = BLK_READY;
+	return HAL_SUCCESS;
+}
+
+bool blkDisconnect(HostBlockDevice *bdp) {
+	bdp->state = BLK_ACTIVE;
+	return HAL_SUCCESS;
+}
+
+bool blkRead(HostBlockDevice *bdp, uint32_t startblk, uint8_t *buf, uint32_t n) {
+	bool err = HAL_SUCCESS;
+
+	if (bdp->state != BLK_READY)
+		return HAL_FAILED;
+	bdp->state = BLK_READING;
+	if (fseek(image, (long) startblk * CARD_BLOCK_SIZE, SEEK_SET) != 0
+			|| fread(buf, CARD_BLOCK_SIZE, n, image) != n)
+		err = HAL_FAILED;
+	ncommands++;
+	nsectors += n;
+	if (latency)
+		chThdSleepMicroseconds(latency * n);
+	if (stallEvery && ncommands % stallEvery == 0) {
+		chThdSleepMilliseconds(stallMs);
+		nstalls++;
+	}
+	bdp->state = BLK_READY;
+	return err;
+}
+
+bool blkGetInfo(HostBlockDevice *bdp, BlockDeviceInfo *bdip) {
+	(void) bdp;
+	if (!image || fseek(image, 0, SEEK_END) != 0)
+		return HAL_FAILED;
+	bdip->blk_size = CARD_BLOCK_SIZE;
+	bdip->blk_num = (uint32_t) (ftell(image) / CARD_BLOCK_SIZE);
+	return HAL_SUCCESS;
+}
+
+#if _FS_REENTRANT
+/* As the ChibiOS FatFs bindings: one semaphore per volume.*/
+static semaphore_t ff_sem[_VOLUMES];
+
+int ff_cre_syncobj(BYTE vol, _SYNC_t *sobj) {
+	*sobj = &ff_sem[vol];
+	chSemObjectInit(*sobj, 1);
+	return TRUE;
+}
+
+int ff_del_syncobj(_SYNC_t sobj) {
+	chSemReset(sobj, 0);
+	return TRUE;
+}
+
+int ff_req_grant(_SYNC_t sobj) {
+	return chSemWaitTimeout(sobj, (systime_t) _FS_TIMEOUT) == MSG_OK;
+}
+
+void ff_rel_grant(_SYNC_t sobj) {
+	chSemSignal(sobj);
+}
+#endif
+
+DWORD get_fattime(void) {
+	return ((uint32_t) 0 | (1 << 16)) | (1 << 21);	/* wrong but valid time */
+}
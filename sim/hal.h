@@ -0,0 +1,146 @@
+/*
+ * hal.h
+ *
+ * Host stand-in for the parts of the ChibiOS HAL seen by the player. The
+ * DAC and GPT drivers are replaced as a whole by the virtual DAC in
+ * codec_sim.c, so only the shared types are needed here, plus a channel
+ * over a file descriptor for the serial source and a block device over
+ * the disk image for the FatFs binding of the firmware.
+ *
+ * Built with HAL_USE_MMC_SPI or HAL_USE_SDC set, as by 'make cards', it
+ * declares the card driver of that backend instead, enough for card.h and
+ * cardDiskio.c to compile as they do for the boards.
+ */
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include "ch.h"
+
+typedef uint16_t dacsample_t;
+
+/* Build with UDEFS=-DSTM32_DAC_DUAL_MODE=TRUE for the two channel DAC.*/
+#if !defined(STM32_DAC_DUAL_MODE)
+#define STM32_DAC_DUAL_MODE		FALSE
+#endif
+
+/* Realtime counter clock, see chSysGetRealtimeCounterX().*/
+#define STM32_HCLK				SIM_RTC_FREQUENCY
+
+#define HAL_SUCCESS				FALSE
+#define HAL_FAILED				TRUE
+
+/* Channels read from a file descriptor on the host, e.g. a pipe.*/
+typedef struct {
+	int						fd;
+} BaseChannel;
+
+#if !defined(HAL_USE_MMC_SPI)
+#define HAL_USE_MMC_SPI			FALSE
+#endif
+#if !defined(HAL_USE_SDC)
+#define HAL_USE_SDC				FALSE
+#endif
+
+/* Block devices as hal_ioblock.h, HBD1 over the disk image (diskio_sim.c)
+   is the card of card.h.*/
+typedef enum {
+	BLK_UNINIT = 0,
+	BLK_STOP,
+	BLK_ACTIVE,
+	BLK_CONNECTING,
+	BLK_DISCONNECTING,
+	BLK_READY,
+	BLK_READING,
+	BLK_WRITING,
+	BLK_SYNCING
+} blkstate_t;
+
+typedef struct {
+	uint32_t				blk_size;
+	uint32_t				blk_num;
+} BlockDeviceInfo;
+
+typedef struct {
+	blkstate_t				state;
+} HostBlockDevice;
+
+#if HAL_USE_MMC_SPI
+/* MMC over SPI as hal_mmc_spi.h, only the fields cardDiskio.c uses.*/
+typedef struct SPIDriver SPIDriver;
+typedef struct SPIConfig SPIConfig;
+
+typedef struct {
+	SPIDriver				*spip;
+	const SPIConfig			*lscfg;
+	const SPIConfig			*hscfg;
+} MMCConfig;
+
+typedef struct {
+	blkstate_t				state;
+	const MMCConfig			*config;
+	bool					block_addresses;
+} MMCDriver;
+
+#define MMCSD_BLOCK_SIZE				512
+#define MMCSD_CMD_STOP_TRANSMISSION		12
+#define MMCSD_CMD_READ_SINGLE_BLOCK		17
+#define MMCSD_CMD_READ_MULTIPLE_BLOCK	18
+#endif
+
+#if HAL_USE_SDC
+/* The SDIO driver as hal_sdc.h.*/
+typedef struct {
+	blkstate_t				state;
+} SDCDriver;
+#endif
+
+#if !HAL_USE_MMC_SPI && !HAL_USE_SDC
+#define CARD_BACKEND			CARD_HOST
+#endif
+
+#define blkGetDriverState(ip)	((ip)->state)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+size_t chnReadTimeout(BaseChannel *chp, uint8_t *bp, size_t n, systime_t time);
+
+#if HAL_USE_MMC_SPI || HAL_USE_SDC
+/* Any block device, as the macros of hal_ioblock.h.*/
+bool blkIsInserted(void *bdp);
+bool blkIsWriteProtected(void *bdp);
+bool blkConnect(void *bdp);
+bool blkDisconnect(void *bdp);
+bool blkRead(void *bdp, uint32_t startblk, uint8_t *buf, uint32_t n);
+bool blkGetInfo(void *bdp, BlockDeviceInfo *bdip);
+#else
+extern HostBlockDevice HBD1;
+
+bool blkIsInserted(HostBlockDevice *bdp);
+bool blkIsWriteProtected(HostBlockDevice *bdp);
+bool blkConnect(HostBlockDevice *bdp);
+bool blkDisconnect(HostBlockDevice *bdp);
+bool blkRead(HostBlockDevice *bdp, uint32_t startblk, uint8_t *buf, uint32_t n);
+bool blkGetInfo(HostBlockDevice *bdp, BlockDeviceInfo *bdip);
+#endif
+
+#if HAL_USE_MMC_SPI
+void spiStart(SPIDriver *spip, const SPIConfig *config);
+void spiSelect(SPIDriver *spip);
+void spiUnselect(SPIDriver *spip);
+void spiSend(SPIDriver *spip, size_t n, const void *txbuf);
+void spiReceive(SPIDriver *spip, size_t n, void *rxbuf);
+void spiIgnore(SPIDriver *spip, size_t n);
+#endif
+
+#if HAL_USE_SDC
+extern SDCDriver SDCD1;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAL_H_ */
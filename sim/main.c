@@ -0,0 +1,349 @@
+/*
+ * main.c
+ *
+ * Host simulation entry point: mounts a FAT disk image, plays one WAV file
+ * through the unmodified player into the virtual DAC and reports refill
+ * latency, underruns and CPU cost per buffer.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "sim.h"
+
+#include "ff.h"
+#include "wavePlayer.h"
+#include "waveSource.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+FATFS MMC_FS;
+
+/* FS mounted and ready.*/
+bool fs_ready = FALSE;
+
+/*
+ * Test double source: a mono 16-bit WAV of a sawtooth, made up as it is
+ * read and handed out at no more than "rate" bytes per second of wall
+ * time, 0 for no limit. Like the card it stalls for "stallMs" every
+ * "stallEvery" reads.
+ */
+typedef struct {
+	waveSource	src;
+	uint8_t		header[44];
+	DWORD		size;
+	DWORD		pos;
+	uint32_t	rate;
+	uint64_t	start;
+	uint32_t	stallMs;
+	uint32_t	stallEvery;
+	uint32_t	reads;
+	uint32_t	stalls;
+} toneSource;
+
+static FRESULT tone_read(waveSource *src, void *buf, UINT btr, UINT *br) {
+	toneSource *ts = (toneSource*) src;
+	uint8_t *p = buf;
+	UINT n;
+
+	if (btr > ts->size - ts->pos)
+		btr = ts->size - ts->pos;
+	if (ts->stallEvery && ++ts->reads % ts->stallEvery == 0) {
+		chThdSleepMilliseconds(ts->stallMs);
+		ts->stalls++;
+	}
+	if (ts->rate) {
+		uint64_t due = ts->start + (uint64_t) (ts->pos + btr) * 1000000000ULL / ts->rate;
+		uint64_t now = sim_now_ns();
+		if (due > now)
+			chThdSleepMicroseconds((uint32_t) ((due - now) / 1000));
+	}
+	for (n = 0; n < btr; n++, ts->pos++) {
+		if (ts->pos < sizeof(ts->header)) {
+			p[n] = ts->header[ts->pos];
+		} else {
+			// little endian samples, 256 values a period
+			uint32_t i = (ts->pos - sizeof(ts->header)) / 2;
+			uint16_t v = (uint16_t) ((i & 0xFF) << 8) ^ 0x8000;
+			p[n] = (ts->pos & 1) ? (uint8_t) (v >> 8) : (uint8_t) v;
+		}
+	}
+	*br = n;
+	return FR_OK;
+}
+
+static FRESULT tone_seek(waveSource *src, DWORD ofs) {
+	toneSource *ts = (toneSource*) src;
+
+	ts->pos = ofs < ts->size ? ofs : ts->size;
+	return FR_OK;
+}
+
+static DWORD tone_tell(waveSource *src) {
+	return ((toneSource*) src)->pos;
+}
+
+static DWORD tone_size(waveSource *src) {
+	return ((toneSource*) src)->size;
+}
+
+static void tone_close(waveSource *src) {
+	(void) src;
+}
+
+static const struct waveSourceVMT toneVMT = {
+	tone_read, tone_seek, tone_tell, tone_size, tone_close
+};
+
+static void put32(uint8_t *p, uint32_t v) {
+	p[0] = (uint8_t) v; p[1] = (uint8_t) (v >> 8);
+	p[2] = (uint8_t) (v >> 16); p[3] = (uint8_t) (v >> 24);
+}
+
+static void tone_init(toneSource *ts, uint32_t sampleRate, uint32_t ms, uint32_t rate) {
+	uint32_t data = (uint32_t) ((uint64_t) sampleRate * ms / 1000) * 2;
+	uint8_t *h = ts->header;
+
+	memcpy(h, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x01\0", 24);
+	put32(h + 4, 36 + data);
+	put32(h + 24, sampleRate);
+	put32(h + 28, sampleRate * 2);
+	memcpy(h + 32, "\x02\0\x10\0data", 8);
+	put32(h + 40, data);
+	ts->src.vmt = &toneVMT;
+	ts->size = sizeof(ts->header) + data;
+	ts->pos = 0;
+	ts->rate = rate;
+	ts->start = sim_now_ns();
+	ts->stallMs = 0;
+	ts->stallEvery = 0;
+	ts->reads = 0;
+	ts->stalls = 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"Usage: %s [-s speed] [-c cpuscale] [-l us] [-o sink] [-p] [-r] [-n] [-v volume] [-a ms] [-t ms] [-m voice]... [-b sound] [-i] [-g hz,ms[,Bps]] [-k ms,n] [-u n] [-j ms,to] [-w] image file...\n"
+		"  -s speed     virtual DAC speed, 1.0 = real time, 0 = lock-step (default)\n"
+		"  -c cpuscale  target/host CPU time ratio used for the budget check (default 1)\n"
+		"  -l us        emulated card latency per sector in us (default 0)\n"
+		"  -k ms,n      emulated card stall of ms every n read commands, or of\n"
+		"               the generated file every n reads\n"
+		"  -u n         exit with status 3 if the player counts more than n\n"
+		"               underruns per stall, n in all without stalls\n"
+		"  -o sink      write the samples consumed by the virtual DAC to a file\n"
+		"  -p           start the DAC after the first half buffer (prefetch)\n"
+		"  -r           resample rates the DAC timer cannot hit\n"
+		"  -n           no resampling (default)\n"
+		"  -v volume    volume in percent (default 100)\n"
+		"  -a ms        start the first file ms into its data\n"
+		"  -t ms        stop the player after ms of wall time\n"
+		"  -j ms,to     seek to to ms into the data after ms of wall time\n"
+		"  -w           exit with status 4 if a refill did not start its read\n"
+		"               on a sector\n"
+		"  -m voice     mix a file over the first one, up to 4 times\n"
+		"  -b sound     play a sound from the bank first, the files are queued\n"
+		"  -i           play a WAV stream from stdin first, the files are queued\n"
+		"  -g hz,ms,Bps play a generated hz, ms long WAV first, read at up to Bps\n"
+		"               bytes per second, the files are queued\n"
+		"With -b, -i or -g the image can be left out, no file is played then.\n",
+		name);
+}
+
+int main(int argc, char *argv[]) {
+	double speed = 0, cpuScale = 1;
+	uint32_t latency = 0, stopAfter = 0, startAt = 0, stallMs = 0, stallEvery = 0;
+	uint32_t seekAfter = 0, seekTo = 0;
+	bool aligned = FALSE;
+	const char *sinkPath = NULL;
+	const char *sound = NULL;
+	BaseChannel in = {STDIN_FILENO};
+	serialSource serial;
+	toneSource tone;
+	uint32_t toneRate = 0, toneMs = 0, toneLimit = 0;
+	bool stream = FALSE;
+	char *mix[4];
+	int nmix = 0;
+	char path = 0;
+	sim_dac_stats_t stats;
+	playerStats st;
+	waveInfo wi;
+	uint32_t commands, sectors, stalls;
+	int opt, i, queued;
+	long maxUnderruns = -1;
+	bool mounted = FALSE;
+
+	while ((opt = getopt(argc, argv, "s:c:l:k:o:prnv:a:t:m:b:ig:u:j:w")) != -1) {
+		switch (opt) {
+		case 'p': setPrefetch(TRUE); break;
+		case 'r': setResample(TRUE); break;
+		case 'n': setResample(FALSE); break;
+		case 'v': setVolume((uint8_t) atoi(optarg)); break;
+		case 'a': startAt = (uint32_t) atol(optarg); break;
+		case 'm': if (nmix < 4) mix[nmix++] = optarg; break;
+		case 'b': sound = optarg; break;
+		case 'i': stream = TRUE; break;
+		case 'g':
+			if (sscanf(optarg, "%u,%u,%u", &toneRate, &toneMs, &toneLimit) < 2) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 't': stopAfter = (uint32_t) atol(optarg); break;
+		case 's': speed = atof(optarg); break;
+		case 'c': cpuScale = atof(optarg); break;
+		case 'l': latency = (uint32_t) atol(optarg); break;
+		case 'k':
+			if (sscanf(optarg, "%u,%u", &stallMs, &stallEvery) != 2) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'o': sinkPath = optarg; break;
+		case 'u': maxUnderruns = atol(optarg); break;
+		case 'w': aligned = TRUE; break;
+		case 'j':
+			if (sscanf(optarg, "%u,%u", &seekAfter, &seekTo) != 2) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		default: usage(argv[0]); return 2;
+		}
+	}
+	if (argc - optind < (sound || stream || toneRate ? 0 : 2)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	chSysInit();
+	sim_dac_setup(speed, cpuScale, sinkPath);
+	if (optind < argc) {
+		if (sim_disk_open(argv[optind], latency))
+			return 1;
+		sim_disk_stall(stallMs, stallEvery);
+		if (f_mount(&MMC_FS, &path, 1) != FR_OK) {
+			fprintf(stderr, "Failed to mount %s\n", argv[optind]);
+			return 1;
+		}
+		fs_ready = TRUE;
+		mounted = TRUE;
+	}
+
+	if (sound) {
+		if (!playSound(sound)) {
+			fprintf(stderr, "No sound %s in the bank\n", sound);
+			return 1;
+		}
+		queued = optind + 1;
+	} else if (stream || toneRate) {
+		if (stream)
+			serialSourceInit(&serial, &in, MS2ST(1000));
+		else {
+			tone_init(&tone, toneRate, toneMs, toneLimit);
+			tone.stallMs = stallMs;
+			tone.stallEvery = stallEvery;
+		}
+		playSource(stream ? &serial.src : &tone.src);
+		getPlayerStats(&st);
+		if (!playerThread && !st.tracks) {
+			fprintf(stderr, "Failed to start the %s\n", stream ? "stream" : "generated file");
+			return 1;
+		}
+		queued = optind + 1;
+	} else {
+		playFileAt(argv[optind + 1], startAt);
+		getPlayerStats(&st);
+		// a short file may have been played out already
+		if (!playerThread && !st.tracks) {
+			fprintf(stderr, "Failed to start %s\n", argv[optind + 1]);
+			return 1;
+		}
+		queued = optind + 2;
+	}
+	for (i = 0; i < nmix; i++)
+		if (playVoice(mix[i], 100) < 0)
+			fprintf(stderr, "Failed to mix %s\n", mix[i]);
+	for (i = queued; i < argc; i++)
+		if (!queueFile(argv[i]))
+			fprintf(stderr, "Failed to queue %s\n", argv[i]);
+	if (seekAfter) {
+		chThdSleepMilliseconds(seekAfter);
+		seekPlay(seekTo);
+	}
+	if (stopAfter) {
+		chThdSleepMilliseconds(stopAfter);
+		stopPlay();
+	}
+	while (playerThread)
+		chThdSleepMilliseconds(10);
+
+	getWaveInfo(&wi);
+	printf("format           : 0x%04x, %u ch, %lu Hz, %u bits\n",
+		wi.audioFormat, wi.numChannels, (unsigned long) wi.sampleRate, wi.bitsPerSample);
+	printf("data             : %lu bytes at %lu\n", (unsigned long) wi.dataSize, (unsigned long) wi.dataOffset);
+	if (wi.title[0])
+		printf("title            : %s\n", wi.title);
+	printf("fact/cues        : %lu/%lu\n", (unsigned long) wi.factSamples, (unsigned long) wi.numCues);
+
+	sim_dac_get_stats(&stats);
+	sim_disk_get_stats(&commands, &sectors, &stalls);
+	if (toneRate)
+		stalls += tone.stalls;
+	printf("samples played   : %llu\n", (unsigned long long) stats.samples);
+	printf("half period      : %lu us\n", (unsigned long) stats.periodNs / 1000);
+	printf("refills          : %lu\n", (unsigned long) stats.refills);
+	printf("underruns        : %lu\n", (unsigned long) stats.underruns);
+	printf("over CPU budget  : %lu\n", (unsigned long) stats.overbudget);
+	if (stats.refills) {
+		printf("refill latency   : avg %llu us, max %lu us\n",
+			(unsigned long long) (stats.latencySum / stats.refills / 1000),
+			(unsigned long) stats.latencyMax / 1000);
+		printf("refill CPU       : avg %llu us, max %lu us\n",
+			(unsigned long long) (stats.cpuSum / stats.refills / 1000),
+			(unsigned long) stats.cpuMax / 1000);
+	}
+	getPlayerStats(&st);
+	printf("DAC rate         : %lu Hz\n", (unsigned long) st.outRate);
+	printf("player underruns : %lu\n", (unsigned long) st.underruns);
+	printf("player late      : %lu\n", (unsigned long) st.late);
+	printf("unaligned reads  : %lu\n", (unsigned long) st.unaligned);
+	printf("player max refill: %lu us\n", (unsigned long) st.maxRefill);
+	printf("files played     : %lu (%lu gapless)\n", (unsigned long) st.tracks, (unsigned long) st.gapless);
+	printf("start-up         : open %lu, header %lu, read %lu, DMA %lu us\n",
+		(unsigned long) st.openTime, (unsigned long) st.headerTime,
+		(unsigned long) st.firstReadTime, (unsigned long) st.startTime);
+	if (stopAfter)
+		printf("stop latency     : %lu us\n", (unsigned long) st.stopTime);
+	printf("mixing           : %lu voices, max %lu us\n", (unsigned long) st.voices, (unsigned long) st.maxMix);
+	printf("voice start      : %lu us\n", (unsigned long) st.voiceOpenTime);
+	if (st.cacheSize)
+		printf("sample cache     : %lu hits, %lu misses, %lu/%lu bytes\n",
+			(unsigned long) st.cacheHits, (unsigned long) st.cacheMisses,
+			(unsigned long) st.cacheUsed, (unsigned long) st.cacheSize);
+	if (st.aheadSlots)
+		printf("read-ahead       : %lu slots, low %lu, high %lu, %lu waits, max read %lu us\n",
+			(unsigned long) st.aheadSlots, (unsigned long) st.aheadLow, (unsigned long) st.aheadHigh,
+			(unsigned long) st.aheadWaits, (unsigned long) st.maxCardRead);
+	printf("link map         : %lu/%lu words\n", (unsigned long) st.clmtUsed, (unsigned long) st.clmtSize);
+	printf("disk commands    : %lu (%lu sectors)\n", (unsigned long) commands, (unsigned long) sectors);
+	if (stallEvery)
+		printf("stalls           : %lu\n", (unsigned long) stalls);
+
+	if (mounted) {
+		f_mount(NULL, &path, 0);
+		sim_disk_close();
+	}
+	if (aligned && st.unaligned) {
+		fprintf(stderr, "%lu refill reads off a sector boundary\n", (unsigned long) st.unaligned);
+		return 4;
+	}
+	if (maxUnderruns >= 0 && st.underruns > (uint32_t) maxUnderruns * (stalls ? stalls : 1)) {
+		fprintf(stderr, "%lu player underruns over %lu stalls\n",
+			(unsigned long) st.underruns, (unsigned long) stalls);
+		return 3;
+	}
+	return 0;
+}
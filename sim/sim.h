@@ -0,0 +1,54 @@
+/*
+ * sim.h
+ *
+ * Host simulation internals shared by the kernel stand-in, the virtual
+ * DAC and the disk image backend.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include "ch.h"
+
+/*
+ * Called with the kernel lock held each time a thread starts (enter=true)
+ * or stops (enter=false) waiting for events. The virtual DAC uses it to
+ * tell when the player has finished refilling a half buffer.
+ */
+typedef void (*sim_wait_hook_t)(thread_t *tp, bool enter);
+
+typedef struct {
+	uint32_t	refills;		// half buffers handed back to the virtual DAC
+	uint32_t	underruns;		// DMA wrapped into a half still being refilled
+	uint32_t	overbudget;		// refill CPU time (scaled) exceeded a half period
+	uint64_t	latencySum;		// ns, event signalled -> player waiting again
+	uint32_t	latencyMax;		// ns
+	uint64_t	cpuSum;			// ns of player thread CPU time per refill
+	uint32_t	cpuMax;			// ns
+	uint32_t	periodNs;		// duration of one half buffer
+	uint64_t	samples;		// samples consumed by the virtual DAC
+} sim_dac_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern sim_wait_hook_t sim_wait_hook;
+
+void sim_sys_wait(pthread_cond_t *cond);
+bool sim_sys_timedwait(pthread_cond_t *cond, uint64_t deadline_ns);
+uint64_t sim_now_ns(void);
+uint64_t sim_thread_cpu_ns(void);
+
+void sim_dac_setup(double speed, double cpuScale, const char *sinkPath);
+void sim_dac_get_stats(sim_dac_stats_t *stats);
+
+int sim_disk_open(const char *imagePath, uint32_t latencyUs);
+void sim_disk_stall(uint32_t ms, uint32_t every);
+void sim_disk_close(void);
+void sim_disk_get_stats(uint32_t *commands, uint32_t *sectors, uint32_t *stalls);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SIM_H_ */
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+#
+# mkbank.py
+#
+# Packs PCM WAV files into a C sound bank (see wave/soundBank.h) that is
+# linked into flash and played by the DMA straight from there. Each file
+# is converted to the frames the DAC plays: 8-bit files stay 8-bit,
+# deeper ones keep their top 12 bits, extra channels are averaged for one
+# DAC channel or dropped past the first two for two. A ramp from the DAC
+# idle level to mid-scale goes before the data and one back after it.
+#
+# Sounds keep their rate, which the DAC timer rounds, as the player does
+# by default (PLAYER_RESAMPLE FALSE). With -R a rate the timer cannot hit
+# is resampled up to the next of the player's resampling rates that it
+# does, by linear interpolation. Rates the DAC cannot play, outside
+# CODEC_RATE_MIN and CODEC_RATE_MAX of codec_DAC.h, are rejected.
+#
+# usage: mkbank.py [-c channels] [-r ramp_ms] [-R] [-m max_rate]
+#                  -o soundbank.c file.wav...
+#
+# Sounds are named after their file, without directory and extension.
+#
+
+import argparse
+import os
+import struct
+import sys
+import wave
+
+CODEC_TIMER_FREQ = 32000000
+CODEC_RATE_MIN = CODEC_TIMER_FREQ // 65536 + 1
+CODEC_RATE_MAX = 96000
+RESAMPLE_RATES = (8000, 12500, 16000, 25000, 32000, 50000)
+BANK_MAX_FRAMES = 65534
+
+
+def read_wav(path):
+    """Returns (rate, bits, frames) with frames as lists of signed 16-bit
+    samples, the top 16 bits of the file's."""
+    with wave.open(path, 'rb') as w:
+        ch = w.getnchannels()
+        width = w.getsampwidth()
+        rate = w.getframerate()
+        raw = w.readframes(w.getnframes())
+    if width not in (1, 2, 3, 4):
+        sys.exit('%s: %d-bit samples not supported' % (path, width * 8))
+    frames = []
+    step = ch * width
+    for off in range(0, len(raw) - step + 1, step):
+        f = []
+        for c in range(ch):
+            p = off + c * width
+            if width == 1:
+                f.append((raw[p] - 0x80) << 8)
+            else:
+                f.append(struct.unpack_from('<h', raw, p + width - 2)[0])
+        frames.append(f)
+    return rate, width * 8, frames
+
+
+def to_channels(frames, channels):
+    out = []
+    for f in frames:
+        if channels == 1:
+            out.append([int(sum(f) / len(f))])
+        elif len(f) == 1:
+            out.append([f[0], f[0]])
+        else:
+            out.append(f[:2])
+    return out
+
+
+def resample(frames, rate):
+    """Linear interpolation up to the first exact rate above "rate"."""
+    if CODEC_TIMER_FREQ % rate == 0:
+        return rate, frames
+    to = next((r for r in RESAMPLE_RATES if r > rate and CODEC_TIMER_FREQ % r == 0), None)
+    if to is None:
+        return rate, frames
+    n = len(frames) * to // rate
+    out = []
+    for i in range(n):
+        pos = i * rate / to
+        j = int(pos)
+        t = pos - j
+        a = frames[j]
+        b = frames[j + 1] if j + 1 < len(frames) else a
+        out.append([int(round(x + (y - x) * t)) for x, y in zip(a, b)])
+    return to, out
+
+
+def dac_frames(frames, bits, channels, ramp):
+    """Unsigned DAC samples: ramp up, data, ramp down, padded to an even
+    number of frames with the idle level."""
+    mid = 0x80 if bits == 8 else 0x8000
+    samples = []
+    for f in range(ramp):
+        samples += [mid * f // ramp] * channels
+    for fr in frames:
+        for s in fr:
+            samples.append((s >> 8) + 0x80 if bits == 8 else s + 0x8000)
+    for f in range(ramp):
+        samples += [mid * (ramp - f) // ramp] * channels
+    if (len(samples) // channels) % 2:
+        samples += [0] * channels
+    return samples
+
+
+def words(samples, bits):
+    data = struct.pack('<%d%s' % (len(samples), 'B' if bits == 8 else 'H'), *samples)
+    data += b'\0' * (-len(data) % 4)
+    return struct.unpack('<%dI' % (len(data) // 4), data)
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Pack WAV files into a flash sound bank.')
+    ap.add_argument('-c', '--channels', type=int, choices=(1, 2), default=1,
+                    help='DAC channels, 2 with STM32_DAC_DUAL_MODE')
+    ap.add_argument('-r', '--ramp', type=int, default=5, help='ramp length, ms')
+    ap.add_argument('-R', '--resample', action='store_true',
+                    help='resample rates the DAC timer cannot hit, as PLAYER_RESAMPLE')
+    ap.add_argument('-m', '--max-rate', type=int, default=CODEC_RATE_MAX,
+                    help='highest rate, CODEC_RATE_MAX of the build')
+    ap.add_argument('-o', '--output', required=True)
+    ap.add_argument('files', nargs='*')
+    args = ap.parse_args()
+
+    names = set()
+    out = ['/*',
+           ' * %s' % os.path.basename(args.output),
+           ' *',
+           ' * Generated by tools/mkbank.py, do not edit.',
+           ' */',
+           '',
+           '#include "ch.h"',
+           '#include "soundBank.h"',
+           '']
+    table = []
+    for i, path in enumerate(args.files):
+        name = os.path.splitext(os.path.basename(path))[0]
+        if name in names:
+            sys.exit('%s: sound "%s" already in the bank' % (path, name))
+        names.add(name)
+
+        rate, bits, frames = read_wav(path)
+        if not CODEC_RATE_MIN <= rate <= args.max_rate:
+            sys.exit('%s: %d Hz, the DAC plays %d to %d Hz' % (path, rate, CODEC_RATE_MIN, args.max_rate))
+        bits = 8 if bits == 8 else 16
+        frames = to_channels(frames, args.channels)
+        if args.resample:
+            rate, frames = resample(frames, rate)
+        samples = dac_frames(frames, bits, args.channels, rate * args.ramp // 1000)
+        n = len(samples) // args.channels
+        if n > BANK_MAX_FRAMES:
+            sys.exit('%s: %d frames, the bank takes up to %d' % (path, n, BANK_MAX_FRAMES))
+
+        w = words(samples, bits)
+        out.append('// %s: %d Hz, %d-bit, %d frames' % (os.path.basename(path), rate, bits, n))
+        out.append('static const uint32_t sound%d[] = {' % i)
+        for k in range(0, len(w), 8):
+            out.append('\t' + ', '.join('0x%08x' % x for x in w[k:k + 8]) + ',')
+        out.append('};')
+        out.append('')
+        table.append('\t{"%s", sound%d, %d, %d, %d, %d},' % (name, i, n, rate, bits, args.channels))
+
+    out.append('const bankSound soundBank[] = {')
+    out += table
+    out.append('\t{NULL, NULL, 0, 0, 0, 0}')
+    out.append('};')
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,136 @@
+/*
+ * adpcm.c
+ *
+ * IMA/DVI ADPCM as stored in WAV files: each block starts with a 4-byte
+ * header per channel (the first sample, the step index and a pad byte),
+ * followed by 4-byte words of eight 4-bit codes per channel, channels
+ * interleaved word by word and the low nibble first. The decoder works
+ * on a block buffered by the caller and may be asked for any number of
+ * frames at a time, so a block can span several refills.
+ */
+
+#include "ch.h"
+
+#include "adpcm.h"
+
+#define HEADER_SIZE		4		// per channel
+#define WORD_FRAMES		8		// codes per channel word
+
+static const int16_t stepTable[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t indexTable[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+void adpcm_ima_init(adpcm_ima *st, uint8_t channels) {
+	uint8_t c;
+
+	st->data = NULL;
+	st->frame = 0;
+	st->left = 0;
+	st->channels = channels;
+	for (c = 0; c < ADPCM_MAX_CHANNELS; c++) {
+		st->pred[c] = 0;
+		st->index[c] = 0;
+	}
+}
+
+/*
+ * Starts decoding the block of "size" bytes at "blk", which must stay in
+ * place until its frames are decoded. A short last block holds as many
+ * whole words as were written. Returns the number of frames in the block,
+ * 0 if it is shorter than its header.
+ */
+size_t adpcm_ima_block(adpcm_ima *st, const uint8_t *blk, size_t size) {
+	size_t head = HEADER_SIZE * st->channels;
+	uint8_t c;
+
+	st->left = 0;
+	if (size < head)
+		return 0;
+	for (c = 0; c < st->channels; c++, blk += HEADER_SIZE) {
+		st->pred[c] = (int16_t) (blk[0] | (blk[1] << 8));
+		st->index[c] = blk[2] > 88 ? 88 : blk[2];
+	}
+	st->data = blk;
+	st->frame = 0;
+	st->left = (uint16_t) (1 + (size - head) / head * WORD_FRAMES);
+	return st->left;
+}
+
+/*
+ * Decodes up to "frames" frames of the current block into interleaved
+ * 16-bit samples. Returns the number of frames decoded, 0 at the end of
+ * the block.
+ */
+size_t adpcm_ima_decode(adpcm_ima *st, int16_t *out, size_t frames) {
+	uint8_t ch = st->channels;
+	uint8_t c;
+
+	if (frames > st->left)
+		frames = st->left;
+	if (!frames)
+		return 0;
+
+	// one channel at a time so that its state stays in registers
+	for (c = 0; c < ch; c++) {
+		int32_t pred = st->pred[c];
+		int32_t index = st->index[c];
+		uint32_t j = st->frame;
+		int16_t *dst = out + c;
+		size_t n = frames;
+		const uint8_t *p;
+
+		// frame 0 is the header sample
+		if (j == 0) {
+			*dst = (int16_t) pred;
+			dst += ch;
+			if (!--n)
+				continue;
+			j = 1;
+		}
+		j--;	// code number from here on
+		p = st->data + ((j / WORD_FRAMES) * ch + c) * HEADER_SIZE + (j % WORD_FRAMES) / 2;
+
+		while (n--) {
+			uint8_t code = (j & 1) ? *p >> 4 : *p & 0x0F;
+			int32_t step = stepTable[index];
+			int32_t diff = step >> 3;
+
+			if (code & 4) diff += step;
+			if (code & 2) diff += step >> 1;
+			if (code & 1) diff += step >> 2;
+			pred += (code & 8) ? -diff : diff;
+			if (pred > 32767) pred = 32767;
+			else if (pred < -32768) pred = -32768;
+			index += indexTable[code];
+			if (index < 0) index = 0;
+			else if (index > 88) index = 88;
+
+			*dst = (int16_t) pred;
+			dst += ch;
+			// next byte after a high nibble, next word of this channel
+			// after the last one
+			if (j & 1)
+				p += (j % WORD_FRAMES == WORD_FRAMES - 1) ? HEADER_SIZE * ch - 3 : 1;
+			j++;
+		}
+		st->pred[c] = (int16_t) pred;
+		st->index[c] = (uint8_t) index;
+	}
+
+	st->frame += frames;
+	st->left -= frames;
+	return frames;
+}
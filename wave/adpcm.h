@@ -0,0 +1,34 @@
+/*
+ * adpcm.h
+ *
+ * IMA/DVI ADPCM block decoder for WAV files (format 0x0011), 4 bits per
+ * sample expanded to 16-bit signed samples.
+ */
+
+#ifndef ADPCM_H_
+#define ADPCM_H_
+
+#define ADPCM_MAX_CHANNELS	2
+
+typedef struct _adpcm_ima
+{
+	const uint8_t	*data;		// first data word of the current block
+	uint16_t	frame;			// next frame in the block
+	uint16_t	left;			// frames left in the block
+	uint8_t		channels;
+	int16_t		pred[ADPCM_MAX_CHANNELS];	// predictor and step index
+	uint8_t		index[ADPCM_MAX_CHANNELS];
+} adpcm_ima;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void adpcm_ima_init(adpcm_ima *st, uint8_t channels);
+size_t adpcm_ima_block(adpcm_ima *st, const uint8_t *blk, size_t size);
+size_t adpcm_ima_decode(adpcm_ima *st, int16_t *out, size_t frames);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ADPCM_H_ */
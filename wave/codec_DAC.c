@@ -14,6 +14,7 @@
 #define DACTIMER			GPTD6
 #define DAC_GPIO			GPIOA
 #define DAC_PIN				GPIOA_PIN4
+#define DAC2_PIN			GPIOA_PIN5
 
 #define SOUND_EN			FALSE		// use sound control pin
 
@@ -26,13 +27,19 @@
 
 extern thread_t *playerThread;
 
+static const dacsample_t *dmabuf;
+static gptcnt_t period;					// timer period of the running stream
+static volatile uint32_t halfCount;		// halves completed by the DMA
+static volatile uint8_t lastHalf;		// last half completed, free to refill
+
 /*
  * DMA end of transmission callback.
  */
 static void daccb(DACDriver *dacp, const dacsample_t * samples, size_t pos) {
 	(void)dacp;
-	(void)samples;
 	(void)pos;
+	lastHalf = (samples == dmabuf) ? 0 : 1;
+	halfCount++;
 	if (playerThread) {
 		chSysLockFromISR();
 		chEvtSignalI(playerThread, EVT_DAC_TC);
@@ -62,7 +69,7 @@ static DACConfig daccfg = {
 };
 
 static const DACConversionGroup dacconvgrp = {
-	num_channels:	1, 			/* Number of DAC channels */
+	num_channels:	CODEC_CHANNELS,	/* Number of DAC channels */
 	end_cb:			daccb, 		/* End of transfer callback */
 	error_cb:		dacerrcb, 	/* Error callback */
 	trigger:		DAC_TRG(0),	/* */
@@ -72,17 +79,28 @@ static const DACConversionGroup dacconvgrp = {
  * GPT6 configuration
  */
 static const GPTConfig gptcfg = {
-	frequency:	32000000,		/* */
+	frequency:	CODEC_TIMER_FREQ,	/* */
 	callback:	NULL,			/* */
 	cr2:		TIM_CR2_MMS_1,	/* MMS = 010 = TRGO on update event */
 	dier:		0U,
 };
 
-void codec_init(uint8_t numBits) {
+void codec_init(uint8_t numBits, uint8_t numChannels) {
+#if STM32_DAC_DUAL_MODE
+	// frames: 8-bit left | right << 8 (DHR8RD), 16-bit left | right << 16 (DHR12LD)
+	(void)numChannels;
+	daccfg.datamode = DAC_DHRM_8BIT_RIGHT_DUAL;
+	if (numBits == 16) {
+		daccfg.datamode = DAC_DHRM_12BIT_LEFT_DUAL;
+	}
+	palSetPadMode(DAC_GPIO, DAC2_PIN, PAL_MODE_INPUT_ANALOG);
+#else
+	(void)numChannels;
 	daccfg.datamode = DAC_DHRM_8BIT_RIGHT;
 	if (numBits == 16) {
 		daccfg.datamode = DAC_DHRM_12BIT_LEFT;
 	}
+#endif
 
 	palSetPadMode(DAC_GPIO, DAC_PIN, PAL_MODE_INPUT_ANALOG);
 	dacStart(&DACDRIVER, &daccfg);
@@ -99,12 +117,42 @@ void codec_stop(void) {
 #endif
 }
 
-// Send data to codec
-void codec_audio_send(uint16_t sampleRate, dacsample_t *txbuf, size_t n) {
+// Send data to codec, n is the number of DAC transfers (frames) in the
+// whole circular buffer
+void codec_audio_send(uint32_t sampleRate, dacsample_t *txbuf, size_t n) {
 #if defined(SOUND_EN)
 	SOUNDON;
 #endif
+	dmabuf = txbuf;
+	halfCount = 0;
+	lastHalf = 1;
 	dacStartConversion(&DACDRIVER, &dacconvgrp, txbuf, n);
-	gptcnt_t cnt = DACTIMER.clock/sampleRate;
-	gptStartContinuous(&DACTIMER, cnt);
+	// nearest period, the rate is only exact when it divides the clock
+	period = (gptcnt_t) ((gptcfg.frequency + sampleRate / 2) / sampleRate);
+	gptStartContinuous(&DACTIMER, period);
+}
+
+// Holds the stream: without triggers the DAC keeps its output and the DMA
+// its position in the buffer
+void codec_pause(void) {
+	gptStopTimer(&DACTIMER);
+}
+
+// Continues the stream from the sample it was held at
+void codec_resume(void) {
+	gptStartContinuous(&DACTIMER, period);
+}
+
+// Number of half buffers completed by the DMA since codec_audio_send(),
+// optionally with the index of the half it completed last (the one free
+// to refill)
+uint32_t codec_half_count(uint8_t *half) {
+	uint32_t cnt;
+
+	chSysLock();
+	cnt = halfCount;
+	if (half)
+		*half = lastHalf;
+	chSysUnlock();
+	return cnt;
 }
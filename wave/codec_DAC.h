@@ -10,15 +10,44 @@
 
 #define EVT_DAC_TC			(1<<0)	// DAC half/full transmission complete
 #define EVT_DAC_ERR			(1<<1)	// DAC error
-#define DAC_BUFFER_SIZE 	1024	// size = sizeof(dacsample_t) * DAC_BUFFER_SIZE
+
+/*
+ * In dual mode channel 1 plays the left and channel 2 the right channel,
+ * the DMA moves one interleaved frame per transfer.
+ */
+#if STM32_DAC_DUAL_MODE
+#define CODEC_CHANNELS		2
+#else
+#define CODEC_CHANNELS		1
+#endif
+
+/*
+ * The DAC is triggered by a timer counting at CODEC_TIMER_FREQ, a sample
+ * rate is played exactly only when it divides that frequency; others are
+ * rounded to the nearest period.
+ */
+#define CODEC_TIMER_FREQ	32000000
+#define CODEC_RATE_EXACT(rate)	((rate) != 0 && CODEC_TIMER_FREQ % (rate) == 0)
+
+/*
+ * Rates that can be played: the timer period must fit the 16-bit counter,
+ * and the DAC output needs a few microseconds to settle between samples.
+ */
+#define CODEC_RATE_MIN		(CODEC_TIMER_FREQ / 65536 + 1)
+#if !defined(CODEC_RATE_MAX)
+#define CODEC_RATE_MAX		96000
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void codec_init(uint8_t numBits);
+void codec_init(uint8_t numBits, uint8_t numChannels);
 void codec_stop(void);
-void codec_audio_send(uint16_t sampleRate, dacsample_t *txbuf, size_t n);
+void codec_pause(void);
+void codec_resume(void);
+void codec_audio_send(uint32_t sampleRate, dacsample_t *txbuf, size_t n);
+uint32_t codec_half_count(uint8_t *half);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,195 @@
+/*
+ * pcmConv.c
+ *
+ * Sample format conversion kernels. All of them produce unsigned samples
+ * for the DAC: 16-bit values are loaded as they are into the 12-bit left
+ * aligned data register, wider samples are truncated to their 16 most
+ * significant bits. Conversions may run in place (in == out), the output
+ * is never larger than the input, except for G.711 which doubles it.
+ */
+
+#include "ch.h"
+
+#include "pcmConv.h"
+
+#define SIGN16		0x8000U
+#define SIGN16X2	0x80008000UL
+
+/*
+ * Signed to unsigned 16-bit in place: XOR of the sign bits, two samples
+ * per 32-bit word, four words per iteration.
+ */
+void pcm_s16_to_u16(uint16_t *buf, size_t n) {
+	uint32_t *w;
+	size_t words;
+
+	if (n && ((uintptr_t) buf & 2)) {
+		*buf++ ^= SIGN16;
+		n--;
+	}
+	w = (uint32_t *) buf;
+	words = n / 2;
+	while (words >= 4) {
+		w[0] ^= SIGN16X2;
+		w[1] ^= SIGN16X2;
+		w[2] ^= SIGN16X2;
+		w[3] ^= SIGN16X2;
+		w += 4;
+		words -= 4;
+	}
+	while (words--)
+		*w++ ^= SIGN16X2;
+	if (n & 1)
+		*(uint16_t *) w ^= SIGN16;
+}
+
+/*
+ * Signed 24-bit to unsigned 16-bit: four packed samples (three words) per
+ * iteration when the input is word aligned.
+ */
+void pcm_s24_to_u16(const uint8_t *in, uint16_t *out, size_t n) {
+	if (((uintptr_t) in & 3) == 0 && ((uintptr_t) out & 3) == 0) {
+		const uint32_t *src = (const uint32_t *) in;
+		uint32_t *dst = (uint32_t *) out;
+		while (n >= 4) {
+			// little-endian: s0 = b0..b2, s1 = b3..b5, s2 = b6..b8, s3 = b9..b11
+			uint32_t w0 = src[0], w1 = src[1], w2 = src[2];
+			dst[0] = (((w0 >> 8) & 0xFFFFU) | (w1 << 16)) ^ SIGN16X2;
+			dst[1] = ((w1 >> 24) | ((w2 & 0xFFU) << 8) | (w2 & 0xFFFF0000UL)) ^ SIGN16X2;
+			src += 3;
+			dst += 2;
+			n -= 4;
+		}
+		in = (const uint8_t *) src;
+		out = (uint16_t *) dst;
+	}
+	while (n--) {
+		*out++ = (uint16_t) (in[1] | (in[2] << 8)) ^ SIGN16;
+		in += 3;
+	}
+}
+
+/*
+ * Signed 32-bit to unsigned 16-bit: upper halves, two samples per word.
+ */
+void pcm_s32_to_u16(const uint8_t *in, uint16_t *out, size_t n) {
+	const uint32_t *src = (const uint32_t *) in;
+
+	if (((uintptr_t) out & 3) == 0) {
+		uint32_t *dst = (uint32_t *) out;
+		while (n >= 2) {
+			*dst++ = ((src[0] >> 16) | (src[1] & 0xFFFF0000UL)) ^ SIGN16X2;
+			src += 2;
+			n -= 2;
+		}
+		out = (uint16_t *) dst;
+	}
+	while (n--)
+		*out++ = (uint16_t) (*src++ >> 16) ^ SIGN16;
+}
+
+/*
+ * G.711 to unsigned 16-bit through one of the tables below. The input may
+ * sit in the output from n bytes on (in >= out + n bytes), it is then
+ * expanded forwards in place.
+ */
+void pcm_g711_to_u16(const uint8_t *in, uint16_t *out, size_t n, const uint16_t *table) {
+	while (n >= 4) {
+		uint8_t b0 = in[0], b1 = in[1], b2 = in[2], b3 = in[3];
+		out[0] = table[b0];
+		out[1] = table[b1];
+		out[2] = table[b2];
+		out[3] = table[b3];
+		in += 4;
+		out += 4;
+		n -= 4;
+	}
+	while (n--)
+		*out++ = table[*in++];
+}
+
+/*
+ * Unsigned 8-bit samples go to the DAC unchanged, only moved when the
+ * data was not read in place.
+ */
+void pcm_u8_copy(const uint8_t *in, uint8_t *out, size_t n) {
+	if (in == out)
+		return;
+	while (n--)
+		*out++ = *in++;
+}
+
+/*
+ * G.711 decoding tables, indexed by the code byte: the 14-bit (mu-law)
+ * and 13-bit (A-law) linear values scaled to 16 bits as ITU-T G.711
+ * defines them, offset to the unsigned DAC range.
+ */
+const uint16_t pcm_ulaw_table[256] = {
+	0x0284, 0x0684, 0x0A84, 0x0E84, 0x1284, 0x1684, 0x1A84, 0x1E84,
+	0x2284, 0x2684, 0x2A84, 0x2E84, 0x3284, 0x3684, 0x3A84, 0x3E84,
+	0x4184, 0x4384, 0x4584, 0x4784, 0x4984, 0x4B84, 0x4D84, 0x4F84,
+	0x5184, 0x5384, 0x5584, 0x5784, 0x5984, 0x5B84, 0x5D84, 0x5F84,
+	0x6104, 0x6204, 0x6304, 0x6404, 0x6504, 0x6604, 0x6704, 0x6804,
+	0x6904, 0x6A04, 0x6B04, 0x6C04, 0x6D04, 0x6E04, 0x6F04, 0x7004,
+	0x70C4, 0x7144, 0x71C4, 0x7244, 0x72C4, 0x7344, 0x73C4, 0x7444,
+	0x74C4, 0x7544, 0x75C4, 0x7644, 0x76C4, 0x7744, 0x77C4, 0x7844,
+	0x78A4, 0x78E4, 0x7924, 0x7964, 0x79A4, 0x79E4, 0x7A24, 0x7A64,
+	0x7AA4, 0x7AE4, 0x7B24, 0x7B64, 0x7BA4, 0x7BE4, 0x7C24, 0x7C64,
+	0x7C94, 0x7CB4, 0x7CD4, 0x7CF4, 0x7D14, 0x7D34, 0x7D54, 0x7D74,
+	0x7D94, 0x7DB4, 0x7DD4, 0x7DF4, 0x7E14, 0x7E34, 0x7E54, 0x7E74,
+	0x7E8C, 0x7E9C, 0x7EAC, 0x7EBC, 0x7ECC, 0x7EDC, 0x7EEC, 0x7EFC,
+	0x7F0C, 0x7F1C, 0x7F2C, 0x7F3C, 0x7F4C, 0x7F5C, 0x7F6C, 0x7F7C,
+	0x7F88, 0x7F90, 0x7F98, 0x7FA0, 0x7FA8, 0x7FB0, 0x7FB8, 0x7FC0,
+	0x7FC8, 0x7FD0, 0x7FD8, 0x7FE0, 0x7FE8, 0x7FF0, 0x7FF8, 0x8000,
+	0xFD7C, 0xF97C, 0xF57C, 0xF17C, 0xED7C, 0xE97C, 0xE57C, 0xE17C,
+	0xDD7C, 0xD97C, 0xD57C, 0xD17C, 0xCD7C, 0xC97C, 0xC57C, 0xC17C,
+	0xBE7C, 0xBC7C, 0xBA7C, 0xB87C, 0xB67C, 0xB47C, 0xB27C, 0xB07C,
+	0xAE7C, 0xAC7C, 0xAA7C, 0xA87C, 0xA67C, 0xA47C, 0xA27C, 0xA07C,
+	0x9EFC, 0x9DFC, 0x9CFC, 0x9BFC, 0x9AFC, 0x99FC, 0x98FC, 0x97FC,
+	0x96FC, 0x95FC, 0x94FC, 0x93FC, 0x92FC, 0x91FC, 0x90FC, 0x8FFC,
+	0x8F3C, 0x8EBC, 0x8E3C, 0x8DBC, 0x8D3C, 0x8CBC, 0x8C3C, 0x8BBC,
+	0x8B3C, 0x8ABC, 0x8A3C, 0x89BC, 0x893C, 0x88BC, 0x883C, 0x87BC,
+	0x875C, 0x871C, 0x86DC, 0x869C, 0x865C, 0x861C, 0x85DC, 0x859C,
+	0x855C, 0x851C, 0x84DC, 0x849C, 0x845C, 0x841C, 0x83DC, 0x839C,
+	0x836C, 0x834C, 0x832C, 0x830C, 0x82EC, 0x82CC, 0x82AC, 0x828C,
+	0x826C, 0x824C, 0x822C, 0x820C, 0x81EC, 0x81CC, 0x81AC, 0x818C,
+	0x8174, 0x8164, 0x8154, 0x8144, 0x8134, 0x8124, 0x8114, 0x8104,
+	0x80F4, 0x80E4, 0x80D4, 0x80C4, 0x80B4, 0x80A4, 0x8094, 0x8084,
+	0x8078, 0x8070, 0x8068, 0x8060, 0x8058, 0x8050, 0x8048, 0x8040,
+	0x8038, 0x8030, 0x8028, 0x8020, 0x8018, 0x8010, 0x8008, 0x8000
+};
+
+const uint16_t pcm_alaw_table[256] = {
+	0x6A80, 0x6B80, 0x6880, 0x6980, 0x6E80, 0x6F80, 0x6C80, 0x6D80,
+	0x6280, 0x6380, 0x6080, 0x6180, 0x6680, 0x6780, 0x6480, 0x6580,
+	0x7540, 0x75C0, 0x7440, 0x74C0, 0x7740, 0x77C0, 0x7640, 0x76C0,
+	0x7140, 0x71C0, 0x7040, 0x70C0, 0x7340, 0x73C0, 0x7240, 0x72C0,
+	0x2A00, 0x2E00, 0x2200, 0x2600, 0x3A00, 0x3E00, 0x3200, 0x3600,
+	0x0A00, 0x0E00, 0x0200, 0x0600, 0x1A00, 0x1E00, 0x1200, 0x1600,
+	0x5500, 0x5700, 0x5100, 0x5300, 0x5D00, 0x5F00, 0x5900, 0x5B00,
+	0x4500, 0x4700, 0x4100, 0x4300, 0x4D00, 0x4F00, 0x4900, 0x4B00,
+	0x7EA8, 0x7EB8, 0x7E88, 0x7E98, 0x7EE8, 0x7EF8, 0x7EC8, 0x7ED8,
+	0x7E28, 0x7E38, 0x7E08, 0x7E18, 0x7E68, 0x7E78, 0x7E48, 0x7E58,
+	0x7FA8, 0x7FB8, 0x7F88, 0x7F98, 0x7FE8, 0x7FF8, 0x7FC8, 0x7FD8,
+	0x7F28, 0x7F38, 0x7F08, 0x7F18, 0x7F68, 0x7F78, 0x7F48, 0x7F58,
+	0x7AA0, 0x7AE0, 0x7A20, 0x7A60, 0x7BA0, 0x7BE0, 0x7B20, 0x7B60,
+	0x78A0, 0x78E0, 0x7820, 0x7860, 0x79A0, 0x79E0, 0x7920, 0x7960,
+	0x7D50, 0x7D70, 0x7D10, 0x7D30, 0x7DD0, 0x7DF0, 0x7D90, 0x7DB0,
+	0x7C50, 0x7C70, 0x7C10, 0x7C30, 0x7CD0, 0x7CF0, 0x7C90, 0x7CB0,
+	0x9580, 0x9480, 0x9780, 0x9680, 0x9180, 0x9080, 0x9380, 0x9280,
+	0x9D80, 0x9C80, 0x9F80, 0x9E80, 0x9980, 0x9880, 0x9B80, 0x9A80,
+	0x8AC0, 0x8A40, 0x8BC0, 0x8B40, 0x88C0, 0x8840, 0x89C0, 0x8940,
+	0x8EC0, 0x8E40, 0x8FC0, 0x8F40, 0x8CC0, 0x8C40, 0x8DC0, 0x8D40,
+	0xD600, 0xD200, 0xDE00, 0xDA00, 0xC600, 0xC200, 0xCE00, 0xCA00,
+	0xF600, 0xF200, 0xFE00, 0xFA00, 0xE600, 0xE200, 0xEE00, 0xEA00,
+	0xAB00, 0xA900, 0xAF00, 0xAD00, 0xA300, 0xA100, 0xA700, 0xA500,
+	0xBB00, 0xB900, 0xBF00, 0xBD00, 0xB300, 0xB100, 0xB700, 0xB500,
+	0x8158, 0x8148, 0x8178, 0x8168, 0x8118, 0x8108, 0x8138, 0x8128,
+	0x81D8, 0x81C8, 0x81F8, 0x81E8, 0x8198, 0x8188, 0x81B8, 0x81A8,
+	0x8058, 0x8048, 0x8078, 0x8068, 0x8018, 0x8008, 0x8038, 0x8028,
+	0x80D8, 0x80C8, 0x80F8, 0x80E8, 0x8098, 0x8088, 0x80B8, 0x80A8,
+	0x8560, 0x8520, 0x85E0, 0x85A0, 0x8460, 0x8420, 0x84E0, 0x84A0,
+	0x8760, 0x8720, 0x87E0, 0x87A0, 0x8660, 0x8620, 0x86E0, 0x86A0,
+	0x82B0, 0x8290, 0x82F0, 0x82D0, 0x8230, 0x8210, 0x8270, 0x8250,
+	0x83B0, 0x8390, 0x83F0, 0x83D0, 0x8330, 0x8310, 0x8370, 0x8350
+};
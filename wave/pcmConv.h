@@ -0,0 +1,26 @@
+/*
+ * pcmConv.h
+ *
+ * Sample format conversion kernels from WAV data to DAC samples.
+ */
+
+#ifndef PCMCONV_H_
+#define PCMCONV_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pcm_s16_to_u16(uint16_t *buf, size_t n);
+void pcm_s24_to_u16(const uint8_t *in, uint16_t *out, size_t n);
+void pcm_s32_to_u16(const uint8_t *in, uint16_t *out, size_t n);
+void pcm_u8_copy(const uint8_t *in, uint8_t *out, size_t n);
+void pcm_g711_to_u16(const uint8_t *in, uint16_t *out, size_t n, const uint16_t *table);
+
+extern const uint16_t pcm_ulaw_table[256];
+extern const uint16_t pcm_alaw_table[256];
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PCMCONV_H_ */
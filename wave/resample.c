@@ -0,0 +1,118 @@
+/*
+ * resample.c
+ *
+ * Upsampling by linear interpolation between the last two input frames.
+ * The position is a 32-bit fraction advanced by a constant step: each
+ * carry out of it moves one input frame in, so a block of output frames
+ * consumes a number of input frames known in advance (resample_input())
+ * and the converter keeps no buffer beyond the two frames it stands
+ * between. Blocks chain seamlessly, which keeps gapless playback intact.
+ *
+ * Only upsampling is supported (inRate < outRate), at most one input
+ * frame is consumed per output frame.
+ */
+
+#include "ch.h"
+
+#include "resample.h"
+
+/*
+ * Interpolation weight: the top 15 bits of the fraction, so that the
+ * product with a 16-bit difference fits a signed 32-bit word.
+ */
+#define WEIGHT(frac)	((int32_t) ((frac) >> 17))
+
+void resample_init(resampler *rs, uint32_t inRate, uint32_t outRate, uint16_t mid) {
+	uint8_t c;
+
+	rs->step = (uint32_t) (((uint64_t) inRate << 32) / outRate);
+	rs->frac = 0;
+	for (c = 0; c < RESAMPLE_MAX_CHANNELS; c++) {
+		rs->h0[c] = mid;
+		rs->h1[c] = mid;
+	}
+}
+
+/*
+ * Number of input frames the next outFrames output frames consume.
+ */
+size_t resample_input(const resampler *rs, size_t outFrames) {
+	return (size_t) (((uint64_t) rs->frac + (uint64_t) outFrames * rs->step) >> 32);
+}
+
+void resample_u16(resampler *rs, const uint16_t *in, uint16_t *out, size_t outFrames, uint8_t channels) {
+	uint32_t frac = rs->frac, step = rs->step;
+	size_t i;
+
+	if (channels == 1) {
+		int32_t h0 = rs->h0[0], h1 = rs->h1[0];
+		for (i = 0; i < outFrames; i++) {
+			out[i] = (uint16_t) (h0 + (((h1 - h0) * WEIGHT(frac)) >> 15));
+			frac += step;
+			if (frac < step) {		// carry: next input frame
+				h0 = h1;
+				h1 = *in++;
+			}
+		}
+		rs->h0[0] = (uint16_t) h0;
+		rs->h1[0] = (uint16_t) h1;
+	} else {
+		int32_t l0 = rs->h0[0], l1 = rs->h1[0];
+		int32_t r0 = rs->h0[1], r1 = rs->h1[1];
+		for (i = 0; i < outFrames; i++) {
+			int32_t w = WEIGHT(frac);
+			out[0] = (uint16_t) (l0 + (((l1 - l0) * w) >> 15));
+			out[1] = (uint16_t) (r0 + (((r1 - r0) * w) >> 15));
+			out += 2;
+			frac += step;
+			if (frac < step) {
+				l0 = l1;
+				r0 = r1;
+				l1 = in[0];
+				r1 = in[1];
+				in += 2;
+			}
+		}
+		rs->h0[0] = (uint16_t) l0;
+		rs->h1[0] = (uint16_t) l1;
+		rs->h0[1] = (uint16_t) r0;
+		rs->h1[1] = (uint16_t) r1;
+	}
+	rs->frac = frac;
+}
+
+void resample_u8(resampler *rs, const uint8_t *in, uint8_t *out, size_t outFrames, uint8_t channels) {
+	uint32_t frac = rs->frac, step = rs->step;
+	size_t i;
+	uint8_t c;
+
+	if (channels == 1) {
+		int32_t h0 = rs->h0[0], h1 = rs->h1[0];
+		for (i = 0; i < outFrames; i++) {
+			out[i] = (uint8_t) (h0 + (((h1 - h0) * WEIGHT(frac)) >> 15));
+			frac += step;
+			if (frac < step) {
+				h0 = h1;
+				h1 = *in++;
+			}
+		}
+		rs->h0[0] = (uint16_t) h0;
+		rs->h1[0] = (uint16_t) h1;
+	} else {
+		for (i = 0; i < outFrames; i++) {
+			int32_t w = WEIGHT(frac);
+			for (c = 0; c < channels; c++) {
+				int32_t h0 = rs->h0[c];
+				*out++ = (uint8_t) (h0 + (((rs->h1[c] - h0) * w) >> 15));
+			}
+			frac += step;
+			if (frac < step) {
+				for (c = 0; c < channels; c++) {
+					rs->h0[c] = rs->h1[c];
+					rs->h1[c] = *in++;
+				}
+			}
+		}
+	}
+	rs->frac = frac;
+}
@@ -0,0 +1,33 @@
+/*
+ * resample.h
+ *
+ * Fixed-point linear interpolation sample rate converter working on DAC
+ * samples, used to play rates the DAC timer cannot hit exactly.
+ */
+
+#ifndef RESAMPLE_H_
+#define RESAMPLE_H_
+
+#define RESAMPLE_MAX_CHANNELS	2
+
+typedef struct _resampler
+{
+	uint32_t	step;			// input frames per output frame, Q0.32, < 1
+	uint32_t	frac;			// position between h0 and h1, Q0.32
+	uint16_t	h0[RESAMPLE_MAX_CHANNELS];	// last two input frames
+	uint16_t	h1[RESAMPLE_MAX_CHANNELS];
+} resampler;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void resample_init(resampler *rs, uint32_t inRate, uint32_t outRate, uint16_t mid);
+size_t resample_input(const resampler *rs, size_t outFrames);
+void resample_u16(resampler *rs, const uint16_t *in, uint16_t *out, size_t outFrames, uint8_t channels);
+void resample_u8(resampler *rs, const uint8_t *in, uint8_t *out, size_t outFrames, uint8_t channels);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RESAMPLE_H_ */
@@ -0,0 +1,31 @@
+/*
+ * soundBank.h
+ *
+ * Sounds linked into flash by tools/mkbank.py. Each one is stored as the
+ * DAC plays it: unsigned 8-bit or 12-bit left aligned 16-bit samples, one
+ * per DAC channel and frame, framed by ramps from and back to the DAC
+ * idle level, at the file's rate unless resampled by mkbank.py -R. The
+ * data is word aligned and an even number of frames long, so it can be
+ * the circular DMA buffer itself.
+ */
+
+#ifndef SOUNDBANK_H_
+#define SOUNDBANK_H_
+
+// the DMA moves at most 65535 frames per pass
+#define BANK_MAX_FRAMES		65534
+
+typedef struct _bankSound
+{
+	const char	*name;
+	const void	*data;
+	uint32_t	frames;
+	uint32_t	sampleRate;
+	uint8_t		bitsPerSample;	// 8 or 16
+	uint8_t		channels;		// DAC channels, CODEC_CHANNELS
+} bankSound;
+
+// terminated by an entry with a NULL name
+extern const bankSound soundBank[];
+
+#endif /* SOUNDBANK_H_ */
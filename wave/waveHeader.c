@@ -0,0 +1,173 @@
+/*
+ * waveHeader.c
+ *
+ * Single pass RIFF/WAVE chunk walker. The file is read through a caller
+ * supplied buffer, normally one sector: the chunk headers found in it are
+ * walked in place and only a chunk that starts or ends past the buffered
+ * window causes another read, so for common files the whole header costs
+ * one read. Chunks may come in any order; unknown and metadata chunks are
+ * skipped without being read.
+ */
+
+#include "ch.h"
+
+#include "waveHeader.h"
+#include <string.h>
+
+#define ID_RIFF			0x46464952		// 'RIFF' in Little-Endian
+#define ID_WAVE			0x45564157		// 'WAVE'
+#define ID_FMT			0x20746D66		// 'fmt '
+#define ID_DATA			0x61746164		// 'data'
+#define ID_FACT			0x74636166		// 'fact'
+#define ID_CUE			0x20657563		// 'cue '
+#define ID_LIST			0x5453494C		// 'LIST'
+#define ID_INFO			0x4F464E49		// 'INFO'
+#define ID_INAM			0x4D414E49		// 'INAM'
+
+#define CHUNK_HEADER	8
+#define FMT_MIN			16				// WAVEFORMAT + wBitsPerSample
+#define FMT_EXT_MAX		40				// WAVEFORMATEXTENSIBLE
+#define CUE_POINT		24				// size of one cue point record
+
+typedef struct {
+	waveSource	*src;
+	uint8_t		*buf;
+	size_t		size;
+	uint32_t	start;					// file offset of buf[0]
+	uint32_t	avail;					// valid bytes in buf
+} window;
+
+static inline uint16_t le16(const uint8_t *p) {
+	return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+ * Returns a pointer to len bytes at file offset pos, reading the buffer
+ * again from pos if they are not buffered. NULL on errors or if fewer
+ * than len bytes are left in the file.
+ */
+static const uint8_t *wnd_get(window *w, uint32_t pos, size_t len) {
+	UINT br;
+
+	if (pos < w->start || pos + len > w->start + w->avail) {
+		if (len > w->size) return NULL;
+		if (srcSeek(w->src, pos) != FR_OK) return NULL;
+		if (srcRead(w->src, w->buf, w->size, &br) != FR_OK) return NULL;
+		w->start = pos;
+		w->avail = br;
+		if (len > br) return NULL;
+	}
+	return w->buf + (pos - w->start);
+}
+
+static void parse_fmt(const uint8_t *p, uint32_t size, waveInfo *info) {
+	info->audioFormat = le16(p);
+	info->numChannels = le16(p + 2);
+	info->sampleRate = le32(p + 4);
+	info->byteRate = le32(p + 8);
+	info->blockAlign = le16(p + 12);
+	info->bitsPerSample = le16(p + 14);
+	info->validBits = info->bitsPerSample;
+	// cbSize and the extension: samples per block or valid bits, then
+	// the channel mask and the sub-format GUID, its first word is the tag
+	if (size >= FMT_MIN + 4)
+		info->samplesPerBlock = le16(p + 18);
+	if (info->audioFormat == FORMAT_EXTENSIBLE && size >= FMT_EXT_MAX) {
+		info->validBits = le16(p + 18);
+		info->samplesPerBlock = 0;
+		info->audioFormat = le16(p + 24);
+	}
+}
+
+static void parse_info(const uint8_t *p, uint32_t size, waveInfo *info) {
+	uint32_t pos = 4;	// after the list type
+
+	while (pos + CHUNK_HEADER <= size) {
+		uint32_t id = le32(p + pos), len = le32(p + pos + 4);
+		pos += CHUNK_HEADER;
+		if (len > size - pos) break;
+		if (id == ID_INAM) {
+			size_t n = len < WAVE_TITLE_LEN - 1 ? len : WAVE_TITLE_LEN - 1;
+			memcpy(info->title, p + pos, n);
+			info->title[n] = 0;
+			break;
+		}
+		pos += len + (len & 1);
+	}
+}
+
+waveResult wave_parse_header(waveSource *src, uint8_t *buf, size_t size, waveInfo *info) {
+	window w = {src, buf, size, 0, 0};
+	const uint8_t *p;
+	uint32_t pos, end, id, len;
+	bool fmt = false, data = false;
+
+	memset(info, 0, sizeof(*info));
+
+	p = wnd_get(&w, 0, 12);
+	if (!p) return WAVE_IO_ERROR;
+	if (le32(p) != ID_RIFF || le32(p + 8) != ID_WAVE) return WAVE_NOT_RIFF;
+
+	// trust the file size over the RIFF size, files written by streaming
+	// recorders often leave it at 0 or 0xFFFFFFFF
+	end = srcSize(src);
+	pos = 12;
+
+	while (pos + CHUNK_HEADER <= end && !(fmt && data)) {
+		p = wnd_get(&w, pos, CHUNK_HEADER);
+		if (!p) return WAVE_IO_ERROR;
+		id = le32(p);
+		len = le32(p + 4);
+		pos += CHUNK_HEADER;
+
+		switch (id) {
+		case ID_FMT:
+			if (len < FMT_MIN) return WAVE_NO_FMT;
+			p = wnd_get(&w, pos, len < FMT_EXT_MAX ? len : FMT_EXT_MAX);
+			if (!p) return WAVE_NO_FMT;
+			parse_fmt(p, len, info);
+			fmt = true;
+			break;
+		case ID_DATA:
+			info->dataOffset = pos;
+			info->dataSize = len < end - pos ? len : end - pos;
+			data = true;
+			break;
+		case ID_FACT:
+			if (len >= 4 && (p = wnd_get(&w, pos, 4)) != NULL)
+				info->factSamples = le32(p);
+			break;
+		case ID_CUE:
+			if (len >= 4 && (p = wnd_get(&w, pos, 4)) != NULL) {
+				uint32_t i, n = le32(p);
+				info->numCues = n;
+				for (i = 0; i < n && i < WAVE_MAX_CUES && 4 + (i + 1) * CUE_POINT <= len; i++) {
+					// dwName, dwPosition, fccChunk, dwChunkStart, dwBlockStart, dwSampleOffset
+					p = wnd_get(&w, pos + 4 + i * CUE_POINT, CUE_POINT);
+					if (!p) break;
+					info->cues[i] = le32(p + 20);
+				}
+			}
+			break;
+		case ID_LIST:
+			// only small INFO lists are read, anything else is skipped
+			if (len >= 4 && len <= size && (p = wnd_get(&w, pos, len)) != NULL && le32(p) == ID_INFO)
+				parse_info(p, len, info);
+			break;
+		default:
+			break;
+		}
+
+		// chunks are word aligned, odd sizes have one pad byte
+		if (len > end - pos) break;
+		pos += len + (len & 1);
+	}
+
+	if (!fmt) return WAVE_NO_FMT;
+	if (!data) return WAVE_NO_DATA;
+	return WAVE_OK;
+}
@@ -0,0 +1,54 @@
+/*
+ * waveHeader.h
+ */
+
+#ifndef WAVEHEADER_H_
+#define WAVEHEADER_H_
+
+#include "waveSource.h"
+
+#define FORMAT_PCM			0x0001
+#define FORMAT_ALAW			0x0006
+#define FORMAT_MULAW		0x0007
+#define FORMAT_IMA_ADPCM	0x0011
+#define FORMAT_EXTENSIBLE	0xFFFE
+
+#define WAVE_MAX_CUES		4		// cue point positions kept
+#define WAVE_TITLE_LEN		32		// LIST/INFO INAM, including terminator
+
+typedef enum {
+	WAVE_OK = 0,
+	WAVE_IO_ERROR,					// source read or seek failed
+	WAVE_NOT_RIFF,					// no RIFF/WAVE signature
+	WAVE_NO_FMT,					// fmt chunk missing or truncated
+	WAVE_NO_DATA					// data chunk missing
+} waveResult;
+
+typedef struct _waveInfo
+{
+	uint16_t	audioFormat;		// format tag, sub-format for EXTENSIBLE
+	uint16_t	numChannels;
+	uint32_t	sampleRate;
+	uint32_t	byteRate;
+	uint16_t	blockAlign;
+	uint16_t	bitsPerSample;		// container size
+	uint16_t	validBits;			// significant bits, EXTENSIBLE only
+	uint16_t	samplesPerBlock;	// compressed formats, from the fmt extension
+	uint32_t	dataOffset;			// file offset of the first sample
+	uint32_t	dataSize;			// bytes, clamped to the file size
+	uint32_t	factSamples;		// fact chunk sample length, 0 if absent
+	uint32_t	numCues;			// cue points in the file
+	uint32_t	cues[WAVE_MAX_CUES];	// sample offsets of the first cue points
+	char		title[WAVE_TITLE_LEN];	// empty if absent
+} waveInfo;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+waveResult wave_parse_header(waveSource *src, uint8_t *buf, size_t size, waveInfo *info);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WAVEHEADER_H_ */
@@ -8,247 +8,1971 @@
 #include "ff.h"
 #include "wavePlayer.h"
 #include "codec_DAC.h"
+#include "pcmConv.h"
+#include "waveHeader.h"
+#include "waveSource.h"
+#include "waveReader.h"
+#include "resample.h"
+#include "adpcm.h"
+#include "soundBank.h"
 #include <string.h>
 
 #define PLAYER_PRIO		(NORMALPRIO+1)
-#define HEADERMAX		128
+#define OPENER_PRIO		NORMALPRIO	// below the player, see open_ahead()
+#define EVT_PLAYER_STOP	(1<<2)	// wakes the player up to terminate
+#define EVT_PLAYER_PAUSE	(1<<3)
+#define EVT_PLAYER_RESUME	(1<<4)
+#define EVT_PLAYER_SEEK	(1<<5)
+#define PLAYER_HALF_MIN		32		// frames, also the half size granularity
+#define PLAYER_MAX_CHANNELS	8
+#define SECTOR_SIZE		512
 #define DEBUG			FALSE
 
+/*
+ * Player thread stack. Opening and parsing files, opening voices and the
+ * FatFs calls down to the card driver, locked for _FS_REENTRANT, all run
+ * on it, in the -O0 build of the firmware Makefile. Size it from the free
+ * column of the shell's threads command after playing with voices.
+ */
+#if !defined(PLAYER_STACK_SIZE)
+#define PLAYER_STACK_SIZE	1024
+#endif
+
+// the opener makes the same file calls, parse errors printed included
+#if !defined(OPENER_STACK_SIZE)
+#define OPENER_STACK_SIZE	PLAYER_STACK_SIZE
+#endif
+
 #if DEBUG
 #define CONSOLE	SD1
 #include "chprintf.h"
 #endif
 
-#define FORMAT_PCM		1
-#define RIFF			0x46464952		// 'FIRR' = RIFF in Little-Endian format
-#define WAVE			0x45564157		// 'WAVE' in Little-Endian
-#define DATA			0x61746164		// 'data' in Little-Endian
-#define FMT				0x20746D66		// 'fmt ' in Little-Endian
-
-typedef struct _chunk
-{
-	uint32_t    id;
-	uint32_t    size;
- } chunk;
-
-typedef struct _RIFFHeader
-{
-	 chunk       descriptor;  // "RIFF"
-	 uint32_t    type;        // "WAVE"
-} RIFFHeader;
-
-typedef struct _WAVEHeader
-{
-     chunk       descriptor;
-     uint16_t    audioFormat;	// 1 - PCM
-     uint16_t    numChannels;	// 1 - mono
-     uint32_t    sampleRate;	//
-     uint32_t    byteRate;		// byteRate = SampleRate * BlockAlign
-     uint16_t    blockAlign;	// BlockAlign = bitsPerSample / 8 * NumChannels
-     uint16_t    bitsPerSample;
-} WAVEHeader;
-
-typedef struct _DATAHeader
-{
-	chunk       descriptor;
-} DATAHeader;
-
-typedef struct _FILEHeader
-{
-    RIFFHeader  riff;
-    WAVEHeader  wave;
-} FILEHeader;
+/*
+ * Ping-pong buffering: the DMA plays the DAC buffer circularly, the buffer
+ * is split in two halves of halfFrames frames each and the player refills
+ * the half the DMA has just completed while the other one is playing.
+ * PLAYER_HALF_MAX sets the RAM reserved for the buffer, enough for two
+ * halves of 16-bit stereo frames; the half size in use can be lowered at
+ * run time with setHalfSize().
+ *
+ * With a single DAC channel, files with more channels are read into the
+ * spare end of the buffer and downmixed into the half in the same pass as
+ * the format conversion. In dual mode mono files are duplicated to both
+ * channels and files with more than two channels play the first two.
+ */
+#if !defined(PLAYER_HALF_MAX)
+#if defined(STM32F1XX_HD)
+#define PLAYER_HALF_MAX		2048	// frames per half, 16 KiB buffer
+#else
+#define PLAYER_HALF_MAX		512		// frames per half, 4 KiB buffer
+#endif
+#endif
+
+#if !defined(PLAYER_HALF_SIZE)
+#define PLAYER_HALF_SIZE	PLAYER_HALF_MAX
+#endif
+
+#if PLAYER_HALF_SIZE > PLAYER_HALF_MAX || PLAYER_HALF_SIZE < PLAYER_HALF_MIN
+#error "PLAYER_HALF_SIZE out of range"
+#endif
+
+/*
+ * Streaming reads: when a half is a whole number of sectors the data is
+ * preceded by up to one sector of mid-scale so that every refill starts on
+ * a sector boundary. f_read() then transfers the half with one multi-block
+ * read straight into the DAC buffer instead of going through the FatFs
+ * window one sector at a time.
+ */
+#if !defined(PLAYER_STREAMING)
+#define PLAYER_STREAMING	TRUE
+#endif
+
+/*
+ * Fast seek: a cluster link map table (CLMT) is built when the file is
+ * opened so reads and seeks never walk the FAT chain. The table takes two
+ * words per contiguous fragment plus two; files with more fragments than
+ * fit are played with plain chain walking.
+ */
+#if !defined(PLAYER_FASTSEEK)
+#define PLAYER_FASTSEEK		_USE_FASTSEEK
+#endif
+
+#if !defined(PLAYER_CLMT_SIZE)
+#define PLAYER_CLMT_SIZE	64		// words, i.e. up to 31 fragments
+#endif
+
+#if PLAYER_FASTSEEK && !_USE_FASTSEEK
+#error "PLAYER_FASTSEEK requires _USE_FASTSEEK in ffconf.h"
+#endif
+
+/*
+ * Read-ahead: the data is read by the reader thread of waveReader.c into
+ * a ring of slots well ahead of the DMA, refills only copy from there.
+ * The player thread still reads the headers of queued files and the
+ * voices from the card, and waits for the card while the reader uses it.
+ * The reader aligns its reads to sectors, streaming reads do not apply.
+ * The ring only helps when it holds more than a half, which the parts
+ * with 16 KiB of RAM cannot spare.
+ */
+#if !defined(PLAYER_READ_AHEAD)
+#if defined(STM32F1XX_HD)
+#define PLAYER_READ_AHEAD	TRUE
+#else
+#define PLAYER_READ_AHEAD	FALSE
+#endif
+#endif
+
+#if PLAYER_READ_AHEAD && !_FS_REENTRANT
+#error "PLAYER_READ_AHEAD requires _FS_REENTRANT in ffconf.h"
+#endif
 
 extern bool fs_ready;
-static dacsample_t dacbuffer[DAC_BUFFER_SIZE];
+extern FATFS MMC_FS;
+static uint32_t dacbuffer[PLAYER_HALF_MAX * 2];
+static size_t halfSize = PLAYER_HALF_SIZE;
+
+/*
+ * Prefetch start: the DMA is started as soon as the first half is filled
+ * and the second half is read while the first one plays, which saves one
+ * refill time from play to sound at the risk of an underrun when the
+ * card is slow.
+ */
+#if !defined(PLAYER_PREFETCH)
+#define PLAYER_PREFETCH		FALSE
+#endif
+
+static bool prefetch = PLAYER_PREFETCH;
+static rtcnt_t playStart;			// playFile() entry, for the start-up latency
+
+/*
+ * Software volume: a Q15 gain applied in the conversion pass. Changes
+ * ramp at GAIN_STEP per frame, under 0.1 s from silence to full scale at
+ * 44.1 kHz, so stepping the volume does not produce zipper noise.
+ */
+#define GAIN_UNITY		32768
+#define GAIN_STEP		8
+
+/*
+ * Click-free start and stop: the DAC idles at 0, so the output ramps up
+ * to mid-scale over PLAYER_RAMP_MS ahead of the data. On stop, and after
+ * the last data, a closing half fades the audio out to mid-scale and
+ * ramps down to 0 before the DAC is switched off. A stop takes at most
+ * three half periods: the half playing, the one queued and the closing
+ * one.
+ */
+#if !defined(PLAYER_RAMP_MS)
+#define PLAYER_RAMP_MS		5
+#endif
+
+static rtcnt_t stopStart;		// stopPlay() entry, for the stop latency
+
+static int32_t gain = GAIN_UNITY;			// at the start of the next block
+static volatile int32_t gainTarget = GAIN_UNITY;
+static uint8_t volume = 100;				// percent
+
+/*
+ * Resampling: a rate the DAC timer cannot hit exactly (CODEC_RATE_EXACT)
+ * is converted up to the lowest of these output rates above it that the
+ * timer does hit, so 44.1 kHz plays at its true speed instead of drifting
+ * with the rounded timer period. Rates above the last one play rounded.
+ * Off by default: the rounded period is at most rate / (2 * timer clock)
+ * off, 0.054% at 44.1 kHz, well below audible pitch error, while the
+ * linear interpolation images the signal above the input Nyquist and a
+ * resampled file is never streamed sector aligned straight from the card.
+ */
+#if !defined(PLAYER_RESAMPLE)
+#define PLAYER_RESAMPLE		FALSE
+#endif
+
+#if !defined(PLAYER_RESAMPLE_RATES)
+#define PLAYER_RESAMPLE_RATES	8000, 12500, 16000, 25000, 32000, 50000
+#endif
+
+static const uint32_t resampleRates[] = {PLAYER_RESAMPLE_RATES};
+static bool resample = PLAYER_RESAMPLE;
+static resampler rs;
 
 uint8_t bitsPerSample;
-uint16_t sampleRate;
+uint32_t sampleRate;
 uint32_t bytesToPlay;
+static uint32_t outRate;		// DAC rate, differs from sampleRate when resampling
+static uint8_t numChannels;
+static uint16_t blockAlign;		// bytes per frame in the file
+static uint8_t outFrame;		// bytes per frame sent to the DAC
+static size_t halfFrames;		// frames per half in this session
+static uint8_t *scratch;		// read buffer when blockAlign > outFrame or resampling
+static size_t leadIn;			// bytes of mid-scale ahead of the first data frame
+static size_t alignSize;		// file bytes the refills are aligned to, or 0
+static size_t alignUnit;		// file bytes between aligned frame starts
+static size_t rampFrames;		// frames of each ramp to and from the DAC idle level
+
+/*
+ * Compressed files are decoded to 16-bit frames as they are read, so the
+ * rest of the refill sees plain PCM: bitsPerSample and blockAlign above
+ * describe the decoded frames. Each IMA ADPCM block is read whole into
+ * the end of the DAC buffer and decoded from there over as many refills
+ * as it takes. G.711 bytes are read into the second half of their place
+ * and expanded through a table straight to DAC samples, which the
+ * conversion pass then leaves as they are.
+ */
+static uint16_t codedAlign;		// bytes per ADPCM block, 0 for PCM
+static uint8_t *coded;			// ADPCM block being decoded
+static adpcm_ima ima;
+static const uint16_t *g711;	// G.711 table, NULL for other formats
+static uint16_t inSign;			// 0x8000 when decoded samples are unsigned
+
+/*
+ * Playlist: files queued with queueFile() wait in a mailbox as indexes
+ * into a pool of path slots. The next file is opened and its header
+ * parsed while the current one plays; when both have the same format the
+ * refill that reaches the end of the current data carries on with the
+ * next file in the same half, so the DMA and its timer never stop.
+ * Files opened ahead parse their header through a small window of their
+ * own as the DAC buffer is busy.
+ */
+#if !defined(PLAYER_QUEUE_LEN)
+#define PLAYER_QUEUE_LEN	8
+#endif
+
+#if !defined(PLAYER_PATH_LEN)
+#define PLAYER_PATH_LEN		64
+#endif
+
+#if !defined(PLAYER_HEADER_SIZE)
+#define PLAYER_HEADER_SIZE	128
+#endif
+
+typedef struct {
+	waveSource	*src;			// file, or a source from playSource()
+	fileSource	file;
+#if PLAYER_READ_AHEAD
+	readerSource	ahead;		// src read ahead, from the data on
+#endif
+	waveInfo	info;
+	uint32_t	startPos;		// data bytes skipped, from playFileAt()
+#if PLAYER_FASTSEEK
+	DWORD		clmt[PLAYER_CLMT_SIZE];
+#endif
+} track;
 
 thread_t* playerThread;
-static FIL file;
+static track tracks[2];
+static track *cur = &tracks[0];		// file being played
+static track *nxt;					// next file, opened ahead, or NULL
+static playerStats stats;
 
-static void i16_conv(uint16_t buf[], uint16_t len) {
-	for (uint16_t i=0; i<len; i++) {
-		buf[i] += 0x8000;
-	}
-}
+/*
+ * Pause holds the DAC trigger with both halves primed, resume restarts it
+ * where it stopped. Seeks take effect at the next refill, the two halves
+ * already buffered still play. Both are carried out by the player thread,
+ * which owns the file and the codec.
+ */
+static bool paused;
+static volatile uint32_t seekTime;		// ms, target of the pending seek
 
-static THD_WORKING_AREA(waPlayerThread, 512);
-static THD_FUNCTION(wavePlayerThread, arg) {
-	(void) arg;
+static msg_t queueBuf[PLAYER_QUEUE_LEN];
+static MAILBOX_DECL(playlist, queueBuf, PLAYER_QUEUE_LEN);
+static char queuePaths[PLAYER_QUEUE_LEN][PLAYER_PATH_LEN];
+static bool queueUsed[PLAYER_QUEUE_LEN];
+static uint8_t hdrbuf[PLAYER_HEADER_SIZE];
 
-	UINT btr;
-	FRESULT err;
-	void *pbuffer;
+/*
+ * Sound bank: sounds linked into flash are stored as DAC frames, ramps
+ * included, and the DMA plays them straight from there: no card, no file
+ * system, no refills. The whole sound is the circular DMA buffer and the
+ * DAC stops once the DMA has completed both halves of it; what it plays
+ * again meanwhile is the start of the ramp, at the idle level. The volume
+ * and the voices do not apply and a stop cuts the sound short.
+ */
+static const bankSound *bank;		// sound being played, or NULL
 
-	chRegSetThreadName("player");
+/*
+ * Mixer: up to PLAYER_VOICES files play over the stream at the same time,
+ * each with its own file, position and gain, e.g. alert beeps over
+ * background music. Voices are 8 or 16-bit PCM, mono or stereo, at the
+ * sample rate of the stream; they are added to each converted half with
+ * saturation, before any resampling, and end with the stream. The player
+ * thread opens and closes their files between refills as FatFs is not
+ * reentrant, playVoice() only hands it the path. A stopped voice fades
+ * out over one half.
+ */
+#if !defined(PLAYER_VOICES)
+#define PLAYER_VOICES		2
+#endif
 
-	pbuffer = dacbuffer;
-	memset(pbuffer, 0, DAC_BUFFER_SIZE * sizeof(dacsample_t));
-	err = f_read(&file, pbuffer, DAC_BUFFER_SIZE * sizeof(dacsample_t), &btr);
-	if (err != FR_OK) goto end;
+#if !defined(PLAYER_VOICE_BUF)
+#define PLAYER_VOICE_BUF	512		// bytes read per voice at a time
+#endif
 
-	if (bitsPerSample == 16) {
-		i16_conv((uint16_t*) pbuffer, DAC_BUFFER_SIZE);
-		codec_audio_send(sampleRate, pbuffer, DAC_BUFFER_SIZE);
-	} else {
-		codec_audio_send(sampleRate, pbuffer, DAC_BUFFER_SIZE*4);	// don't know why
-	}
+/*
+ * Sample cache: voice files with up to PLAYER_CACHE_CLIP data bytes are
+ * kept in RAM, keyed by path, in a private heap of PLAYER_CACHE_SIZE
+ * bytes. A clip is stored as it is read the first time it plays and can
+ * be used once read to the end; playing it again then needs no open, FAT
+ * walk, header parse or card read. To make room the least recently used
+ * clips no voice is playing are freed. flushSampleCache() drops every
+ * clip, e.g. when the card is changed.
+ */
+#if !defined(PLAYER_CACHE_SIZE)
+#if defined(STM32F1XX_HD)
+#define PLAYER_CACHE_SIZE	16384
+#else
+#define PLAYER_CACHE_SIZE	2048
+#endif
+#endif
 
-	bytesToPlay -= btr;
+#if !defined(PLAYER_CACHE_CLIP)
+#define PLAYER_CACHE_CLIP	(PLAYER_CACHE_SIZE / 2)
+#endif
 
-	while (bytesToPlay) {
-    	if (chThdShouldTerminateX()) break;
-		eventmask_t evt = chEvtWaitAny(ALL_EVENTS);
+#if PLAYER_CACHE_SIZE > 0 && PLAYER_VOICES == 0
+#undef PLAYER_CACHE_SIZE
+#define PLAYER_CACHE_SIZE	0
+#endif
 
-	    if (evt & EVT_DAC_ERR) break;
-	    if (evt & EVT_DAC_TC) {
-			err = f_read(&file, pbuffer, DAC_BUFFER_SIZE, &btr);
-			if (err != FR_OK) break;
-			if (btr < DAC_BUFFER_SIZE)
-				memset(pbuffer+btr, 0, DAC_BUFFER_SIZE-btr);
-			if (bitsPerSample == 16) {
-				i16_conv((uint16_t*) pbuffer, DAC_BUFFER_SIZE/2);
-			}
-			if (pbuffer == dacbuffer)
-				pbuffer += DAC_BUFFER_SIZE;
-			else
-				pbuffer = dacbuffer;
-			bytesToPlay -= btr;
-		}
+#if PLAYER_CACHE_SIZE > 0
+#if !CH_CFG_USE_HEAP
+#error "PLAYER_CACHE_SIZE requires CH_CFG_USE_HEAP in chconf.h"
+#endif
 
-	    if (!btr) break;
-	}
+typedef struct _clip {
+	struct _clip	*prev;			// LRU list, most recently used first
+	struct _clip	*next;
+	uint8_t		*data;
+	uint32_t	size;				// data bytes
+	uint32_t	filled;				// bytes read so far, size when usable
+	uint32_t	epoch;				// flushSampleCache() count when stored
+	uint32_t	sampleRate;
+	uint8_t		channels;
+	uint8_t		width;
+	uint8_t		users;				// voices playing from it
+	char		*path;
+} clip;
+#endif
 
-end:
-	codec_stop();
-	f_close(&file);
+#if PLAYER_VOICES > 0
+typedef enum {
+	VOICE_FREE = 0,
+	VOICE_PENDING,					// path set, waiting for the player
+	VOICE_PLAYING
+} voiceState;
 
-	playerThread = NULL;
-	chThdExit((msg_t) 0);
-}
+typedef struct {
+	fileSource	file;
+	uint32_t	bytesLeft;
+	int32_t		gain;				// Q15
+	uint8_t		channels;
+	uint8_t		width;				// bytes per sample
+	volatile uint8_t	state;
+	volatile bool		stop;
+#if PLAYER_CACHE_SIZE > 0
+	clip		*clip;				// clip being played or stored, or NULL
+	bool		inRam;				// played from the clip, no file open
+#endif
+	char		path[PLAYER_PATH_LEN];
+} voice;
 
-void playFile(char* fpath) {
-	uint16_t HeaderLength;
-	FRESULT err;
-	UINT btr;
+static voice voices[PLAYER_VOICES];
+static uint8_t voicebuf[PLAYER_VOICE_BUF];
 
-	if (!fs_ready) {
-#if DEBUG
-	    chprintf((BaseSequentialStream*) &CONSOLE, "File System not mounted\r\n");
+#if PLAYER_CACHE_SIZE > 0
+static memory_heap_t cacheHeap;
+static stkalign_t cachePool[PLAYER_CACHE_SIZE / sizeof(stkalign_t)];
+static bool cacheReady;
+static clip *clips;					// LRU list head
+static uint32_t cacheUsed;			// bytes allocated
+static volatile uint32_t cacheEpoch;
 #endif
-	    return;
+#endif
+
+/*
+ * Most significant 16 bits of a signed sample of "width" bytes.
+ */
+static inline int16_t s16_top(const uint8_t *p, uint8_t width) {
+	return (int16_t) ((p[width-2] | (p[width-1] << 8)) ^ inSign);
+}
+
+/*
+ * Gain for frame i of the block being converted: "gain" moving towards
+ * "target" by GAIN_STEP per frame. It depends on the frame position only,
+ * so loops may run in either direction.
+ */
+static inline int32_t gain_at(int32_t target, size_t i) {
+	int32_t d = target - gain;
+	int32_t r = (int32_t) (i < GAIN_UNITY / GAIN_STEP ? i * GAIN_STEP : GAIN_UNITY);
+
+	if (d > r) return gain + r;
+	if (d < -r) return gain - r;
+	return target;
+}
+
+/*
+ * Converts frames from the file layout in "in" to DAC frames in "out",
+ * applying the volume on the way. "in" is either "out" itself (same or
+ * smaller frame, expanded from the end) or the scratch area (larger
+ * frame, compacted from the start).
+ */
+static void convert(const uint8_t *in, uint8_t *out, size_t frames) {
+	uint8_t width = bitsPerSample / 8;
+	int32_t target = gainTarget;
+	size_t i;
+	uint8_t c;
+
+	// full volume: straight format conversion
+	if (numChannels == CODEC_CHANNELS && gain == GAIN_UNITY && target == GAIN_UNITY) {
+		size_t n = frames * numChannels;
+		switch (bitsPerSample) {
+		case 8:  pcm_u8_copy(in, out, n); break;
+		case 16: if (!g711) pcm_s16_to_u16((uint16_t*) out, n); break;	// always in place
+		case 24: pcm_s24_to_u16(in, (uint16_t*) out, n); break;
+		case 32: pcm_s32_to_u16(in, (uint16_t*) out, n); break;
+		}
+		return;
 	}
 
-	while (playerThread) {
-		stopPlay();
-		chThdSleepMilliseconds(100);
+	if (bitsPerSample > 8) {
+		const uint8_t *src = in;
+		if (CODEC_CHANNELS == 1) {
+			// downmix: average of all channels
+			uint16_t *dst = (uint16_t*) out;
+			for (i = 0; i < frames; i++, src += blockAlign) {
+				int32_t sum = 0;
+				for (c = 0; c < numChannels; c++)
+					sum += s16_top(src + c * width, width);
+				dst[i] = (uint16_t) ((sum / numChannels * gain_at(target, i)) >> 15) ^ 0x8000;
+			}
+		} else if (numChannels == 1) {
+			// mono to both channels, backwards as the frame does not
+			// shrink in place
+			uint32_t *dst = (uint32_t*) out;
+			for (i = frames; i-- > 0;) {
+				int32_t s = (s16_top(src + i * width, width) * gain_at(target, i)) >> 15;
+				dst[i] = (uint32_t) ((uint16_t) s ^ 0x8000) * 0x00010001;
+			}
+		} else {
+			// keep the first two channels
+			uint16_t *dst = (uint16_t*) out;
+			for (i = 0; i < frames; i++, src += blockAlign) {
+				int32_t g = gain_at(target, i);
+				dst[2*i] = (uint16_t) ((s16_top(src, width) * g) >> 15) ^ 0x8000;
+				dst[2*i+1] = (uint16_t) ((s16_top(src + width, width) * g) >> 15) ^ 0x8000;
+			}
+		}
+	} else {
+		const uint8_t *src = in;
+		if (CODEC_CHANNELS == 1) {
+			for (i = 0; i < frames; i++, src += numChannels) {
+				uint32_t sum = 0;
+				for (c = 0; c < numChannels; c++)
+					sum += src[c];
+				out[i] = (uint8_t) (((((int32_t) (sum / numChannels) - 0x80) * gain_at(target, i)) >> 15) + 0x80);
+			}
+		} else if (numChannels == 1) {
+			for (i = frames; i-- > 0;) {
+				uint8_t s = (uint8_t) ((((src[i] - 0x80) * gain_at(target, i)) >> 15) + 0x80);
+				out[2*i+1] = s;
+				out[2*i] = s;
+			}
+		} else {
+			for (i = 0; i < frames; i++, src += numChannels) {
+				int32_t g = gain_at(target, i);
+				out[2*i] = (uint8_t) ((((src[0] - 0x80) * g) >> 15) + 0x80);
+				out[2*i+1] = (uint8_t) ((((src[1] - 0x80) * g) >> 15) + 0x80);
+			}
+		}
 	}
+	gain = gain_at(target, frames);
+}
+
+/*
+ * Opens a file and builds its link map.
+ */
+static bool open_file(track *t, const char *fpath) {
+	FRESULT err;
 
-	err = f_open(&file, fpath, FA_READ);
+	err = fileSourceOpen(&t->file, fpath);
 	if (err != FR_OK) {
 #if DEBUG
 		chprintf((BaseSequentialStream*) &CONSOLE, "Failed to open file %s, error=%d\r\n", fpath, err);
 #endif
-		return;
+		return FALSE;
 	}
-
-	HeaderLength = sizeof(FILEHeader);
-	err = f_read(&file, &dacbuffer, HeaderLength, &btr);
+	t->src = &t->file.src;
+#if PLAYER_FASTSEEK
+	t->file.file.cltbl = t->clmt;
+	t->clmt[0] = PLAYER_CLMT_SIZE;
+	err = f_lseek(&t->file.file, CREATE_LINKMAP);
+	// clmt[0] holds the size needed, even when the table is too small
 	if (err != FR_OK) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error read file %s, error=%d\r\n", fpath, err);
+		chprintf((BaseSequentialStream*) &CONSOLE, "Link map needs %lu words, using FAT chain\r\n", t->clmt[0]);
 #endif
-		return;
+		t->file.file.cltbl = NULL;
 	}
+#endif
+	return TRUE;
+}
 
-	FILEHeader* header = (FILEHeader*) dacbuffer;
-    if (!(header->riff.descriptor.id == RIFF
-        && header->riff.type == WAVE
-        && header->wave.descriptor.id == FMT
-        && header->wave.audioFormat == FORMAT_PCM)) {
+/*
+ * Parses the header of an opened file through the "size" bytes at "buf",
+ * checks the format is supported and seeks to the first sample. The file
+ * is closed on failure.
+ */
+static bool parse_track(track *t, uint8_t *buf, size_t size) {
+	waveInfo *wi = &t->info;
+
+	waveResult res = wave_parse_header(t->src, buf, size, wi);
+	if (res != WAVE_OK) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error: this is not PCM file!\r\n");
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: not a WAVE file, error=%d\r\n", res);
 #endif
-		return;
+		srcClose(t->src);
+		return FALSE;
 	}
 
 #if DEBUG
 	chprintf((BaseSequentialStream*) &CONSOLE,
 		"Number of channels=%d\r\nSample Rate=%ld\r\nNumber of Bits=%d\r\n",
-		header->wave.numChannels, header->wave.sampleRate, header->wave.bitsPerSample);
+		wi->numChannels, wi->sampleRate, wi->bitsPerSample);
 #endif
 
-	if (header->wave.numChannels > 1) {
+	if (wi->audioFormat != FORMAT_PCM && wi->audioFormat != FORMAT_IMA_ADPCM
+		&& wi->audioFormat != FORMAT_ALAW && wi->audioFormat != FORMAT_MULAW) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error: only mono format supported.\r\n");
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: format 0x%04x not supported.\r\n", wi->audioFormat);
 #endif
-		return;
+		srcClose(t->src);
+		return FALSE;
 	}
 
-	if (!(header->wave.bitsPerSample == 8 || header->wave.bitsPerSample == 16)) {
+	if (wi->numChannels == 0 || wi->numChannels > PLAYER_MAX_CHANNELS) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %d bits per sample not supported.\r\n", header->wave.bitsPerSample);
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %d channels not supported.\r\n", wi->numChannels);
 #endif
-		return;
+		srcClose(t->src);
+		return FALSE;
 	}
 
-	sampleRate = header->wave.sampleRate;
-	bitsPerSample = header->wave.bitsPerSample;
-
-	DATAHeader* dataheader = (DATAHeader*) &dacbuffer;
-
-	HeaderLength += sizeof(DATAHeader);
-	err = f_read(&file, &dacbuffer, sizeof(DATAHeader), &btr);
-	if (err != FR_OK) {
+	if (wi->sampleRate < CODEC_RATE_MIN || wi->sampleRate > CODEC_RATE_MAX) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error read file %s, error=%d\r\n", fpath, err);
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %ld Hz not supported.\r\n", wi->sampleRate);
 #endif
-		return;
+		srcClose(t->src);
+		return FALSE;
 	}
 
-	while ((uint32_t) dataheader->descriptor.id != DATA) {
-		if (HeaderLength > HEADERMAX) break;
-		if (dataheader->descriptor.size > 0) {
-			HeaderLength += dataheader->descriptor.size;
-			f_lseek(&file, HeaderLength);
+	if (wi->audioFormat == FORMAT_IMA_ADPCM) {
+		// whole words per channel after the headers, room left for the halves
+		if (wi->bitsPerSample != 4 || wi->numChannels > ADPCM_MAX_CHANNELS
+			|| wi->blockAlign % (4 * wi->numChannels) || wi->blockAlign <= 4 * wi->numChannels
+			|| wi->blockAlign > sizeof(dacbuffer) / 2) {
+#if DEBUG
+			chprintf((BaseSequentialStream*) &CONSOLE, "Error: ADPCM block of %d bytes not supported.\r\n", wi->blockAlign);
+#endif
+			srcClose(t->src);
+			return FALSE;
 		}
-		HeaderLength += sizeof(DATAHeader);
-		err = f_read(&file, &dacbuffer, sizeof(DATAHeader), &btr);
-		if (err != FR_OK) {
+	} else if (wi->audioFormat == FORMAT_ALAW || wi->audioFormat == FORMAT_MULAW) {
+		if (wi->bitsPerSample != 8 || wi->blockAlign != wi->numChannels) {
 #if DEBUG
-			chprintf((BaseSequentialStream*) &CONSOLE, "Error read file %s, error=%d\r\n", fpath, err);
+			chprintf((BaseSequentialStream*) &CONSOLE, "Error: %d bits per sample not supported.\r\n", wi->bitsPerSample);
 #endif
-			return;
+			srcClose(t->src);
+			return FALSE;
 		}
+	} else if (!(wi->bitsPerSample == 8 || wi->bitsPerSample == 16
+		|| wi->bitsPerSample == 24 || wi->bitsPerSample == 32)
+		|| wi->blockAlign != wi->numChannels * (wi->bitsPerSample / 8)) {
+#if DEBUG
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %d bits per sample not supported.\r\n", wi->bitsPerSample);
+#endif
+		srcClose(t->src);
+		return FALSE;
 	}
 
-	if ((uint32_t) dataheader->descriptor.id != DATA) {
+	t->startPos = 0;
+	FRESULT err = srcSeek(t->src, wi->dataOffset);
+	if (err != FR_OK) {
 #if DEBUG
-		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %s data chunk not found\r\n", fpath);
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error read file, error=%d\r\n", err);
 #endif
-		return;
+		srcClose(t->src);
+		return FALSE;
 	}
 
+#if PLAYER_READ_AHEAD
+	readerOpen(&t->ahead, t->src, wi->dataOffset + wi->dataSize);
+	t->src = &t->ahead.src;
+#endif
+
 #if DEBUG
 	chprintf((BaseSequentialStream*) &CONSOLE, "OK, ready to play.\r\n");
+	chprintf((BaseSequentialStream*) &CONSOLE, "Sample Length:%ld bytes at %ld\r\n", wi->dataSize, wi->dataOffset);
 #endif
+	return TRUE;
+}
 
-	bytesToPlay = dataheader->descriptor.size;
-#if DEBUG
-	chprintf((BaseSequentialStream*) &CONSOLE, "Sample Length:%ld bytes\r\n", bytesToPlay);
+/*
+ * Opens the next queued file ahead of time, dropping the ones that cannot
+ * be played. Returns TRUE when nxt is ready.
+ */
+static bool open_next(void) {
+	msg_t slot;
+	msg_t res;
+
+	while (!nxt) {
+		chSysLock();
+		res = chMBFetchI(&playlist, &slot);
+		chSysUnlock();
+		if (res != MSG_OK)
+			return FALSE;
+
+		// cur stays put until nxt is set
+		track *t = (cur == &tracks[0]) ? &tracks[1] : &tracks[0];
+		bool ok = open_file(t, queuePaths[slot]) && parse_track(t, hdrbuf, sizeof(hdrbuf));
+		chSysLock();
+		if (ok)
+			nxt = t;
+		queueUsed[slot] = FALSE;
+		chSysUnlock();
+	}
+	return TRUE;
+}
+
+/*
+ * Opener: while a session plays, the next queued file is opened, its link
+ * map built and its header parsed by a thread below the player, which
+ * preempts it for the refills, rather than by the player in the time left
+ * after one. The opener only runs while nxt is NULL and the player only
+ * reads nxt, the track it hands over, once set. The player waits for it
+ * before it opens files itself, when the data runs out and before it
+ * exits. Both still take turns on the file system lock.
+ */
+static THD_WORKING_AREA(waOpenerThread, OPENER_STACK_SIZE);
+static thread_t *opener;
+
+static THD_FUNCTION(openerThread, arg) {
+	(void) arg;
+	chRegSetThreadName("opener");
+	open_next();
+}
+
+static void wait_opener(void) {
+	if (opener) {
+		chThdWait(opener);
+		opener = NULL;
+	}
+}
+
+/*
+ * Starts the opener when a file is queued and none is opened ahead.
+ */
+static void open_ahead(void) {
+	if (nxt || (opener && !chThdTerminatedX(opener)) || !getQueueCount())
+		return;
+	wait_opener();
+	opener = chThdCreateStatic(waOpenerThread, sizeof(waOpenerThread), OPENER_PRIO, openerThread, NULL);
+}
+
+/*
+ * Data bytes to play: whole frames, or all the blocks for ADPCM where the
+ * last one may be short.
+ */
+static uint32_t data_size(const waveInfo *wi) {
+	if (wi->audioFormat == FORMAT_IMA_ADPCM)
+		return wi->dataSize;
+	return wi->dataSize - wi->dataSize % wi->blockAlign;
+}
+
+/*
+ * Makes the file opened ahead the current one.
+ */
+static void next_track(void) {
+	cur = nxt;
+	nxt = NULL;
+
+	sampleRate = cur->info.sampleRate;
+	bitsPerSample = cur->info.bitsPerSample;
+	numChannels = cur->info.numChannels;
+	blockAlign = cur->info.blockAlign;
+	codedAlign = 0;
+	g711 = NULL;
+	inSign = 0;
+	switch (cur->info.audioFormat) {
+	case FORMAT_IMA_ADPCM:
+		codedAlign = blockAlign;
+		break;
+	case FORMAT_ALAW:
+		g711 = pcm_alaw_table;
+		break;
+	case FORMAT_MULAW:
+		g711 = pcm_ulaw_table;
+		break;
+	}
+	if (codedAlign || g711) {
+		bitsPerSample = 16;
+		blockAlign = 2 * numChannels;
+		inSign = g711 ? 0x8000 : 0;
+	}
+	adpcm_ima_init(&ima, numChannels);
+	bytesToPlay = data_size(&cur->info) - cur->startPos;
+
+	stats.tracks++;
+#if PLAYER_FASTSEEK
+	stats.clmtUsed = cur->clmt[0];
+	stats.clmtSize = PLAYER_CLMT_SIZE;
 #endif
+}
+
+/*
+ * Data byte offset of a time in the file, rounded down to a whole block
+ * and clamped to the data size.
+ */
+static uint32_t data_offset(const waveInfo *wi, uint32_t ms) {
+	uint32_t rate = wi->byteRate ? wi->byteRate : wi->sampleRate * wi->blockAlign;
+	uint32_t size = data_size(wi);
+	uint64_t pos = (uint64_t) ms * rate / 1000;
 
-	codec_init(bitsPerSample);
-	playerThread = chThdCreateStatic(waPlayerThread, sizeof(waPlayerThread), PLAYER_PRIO, wavePlayerThread, NULL);
+	pos -= pos % wi->blockAlign;
+	return pos < size ? (uint32_t) pos : size;
 }
 
-void stopPlay(void) {
-	if (playerThread) {
-		chThdTerminate(playerThread);
-		chThdWait(playerThread);
-		if (chThdTerminatedX(playerThread))	playerThread=NULL;
+/*
+ * Moves a data offset of the current file to where the refills keep the
+ * sector alignment of the session, for a seek while playing: down to the
+ * one before, or up at the very start of the data. Offsets are left as
+ * they are when the refills are not aligned, e.g. past a gapless change
+ * of file.
+ */
+static uint32_t align_offset(uint32_t pos) {
+	DWORD tell, at;
+	size_t lead, off;
+
+	if (!alignSize)
+		return pos;
+	// the reads are aligned once the lead-in left has been played
+	tell = srcTell(cur->src);
+	lead = (leadIn / (g711 ? 2 : 1)) % alignSize;
+	if ((tell + alignSize - lead) % alignSize)
+		return pos;
+	// the same phase as the file position, in whole units
+	at = cur->info.dataOffset + pos;
+	off = (at + alignUnit - tell % alignUnit) % alignUnit;
+	if (pos >= off)
+		return pos - off;
+	if (pos + alignUnit - off <= data_size(&cur->info))
+		return pos + alignUnit - off;
+	return pos;
+}
+
+/*
+ * The data of the file opened ahead can follow the current data in the
+ * same DMA stream.
+ */
+static bool is_gapless(const track *t) {
+	const waveInfo *wi = &cur->info;
+
+	return t->info.audioFormat == wi->audioFormat
+		&& t->info.sampleRate == wi->sampleRate
+		&& t->info.numChannels == wi->numChannels
+		&& t->info.bitsPerSample == wi->bitsPerSample
+		&& t->info.blockAlign == wi->blockAlign;
+}
+
+/*
+ * Data of the current file not yet in the DAC buffer.
+ */
+static inline bool data_left(void) {
+	return bytesToPlay || ima.left;
+}
+
+/*
+ * ADPCM counterpart of srcRead(): decodes up to "len" bytes of frames,
+ * reading the next block first when the current one is used up.
+ */
+static FRESULT read_adpcm(uint8_t *out, size_t len, UINT *br) {
+	FRESULT err;
+	UINT n;
+
+	if (!ima.left) {
+		err = srcRead(cur->src, coded, bytesToPlay < codedAlign ? bytesToPlay : codedAlign, &n);
+		if (err != FR_OK) return err;
+		bytesToPlay = n < codedAlign ? 0 : bytesToPlay - n;
+		adpcm_ima_block(&ima, coded, n);
+	}
+	*br = adpcm_ima_decode(&ima, (int16_t*) out, len / blockAlign) * blockAlign;
+	return FR_OK;
+}
+
+/*
+ * G.711 counterpart of srcRead(): reads up to "len" / 2 bytes into the
+ * second half of their place and expands them in place.
+ */
+static FRESULT read_g711(uint8_t *out, size_t len, UINT *br) {
+	size_t n = len / 2 < bytesToPlay ? len / 2 : bytesToPlay;
+	FRESULT err;
+
+	err = srcRead(cur->src, out + n, n, br);
+	if (err != FR_OK) return err;
+	bytesToPlay -= *br;
+	pcm_g711_to_u16(out + n, (uint16_t*) out, *br, g711);
+	*br *= 2;
+	return FR_OK;
+}
+
+/*
+ * Writes "len" bytes of mid-scale in the file layout.
+ */
+static void fill_silence(uint8_t *p, size_t len) {
+	if (inSign) {
+		uint16_t *s = (uint16_t*) p;
+		for (len /= 2; len; len--)
+			*s++ = inSign;
+	} else {
+		memset(p, bitsPerSample == 8 ? 0x80 : 0, len);
+	}
+}
+
+#if PLAYER_CACHE_SIZE > 0
+static void cache_free(clip *c) {
+	if (c->prev) c->prev->next = c->next;
+	else clips = c->next;
+	if (c->next) c->next->prev = c->prev;
+	cacheUsed -= sizeof(clip) + c->size + strlen(c->path) + 1;
+	chHeapFree(c);
+}
+
+/*
+ * Looks up the clip of a path, freeing the unused clips stored before the
+ * last flushSampleCache() on the way.
+ */
+static clip *cache_find(const char *path) {
+	uint32_t epoch = cacheEpoch;
+	clip *c, *next;
+
+	for (c = clips; c; c = next) {
+		next = c->next;
+		if (c->epoch != epoch) {
+			if (!c->users)
+				cache_free(c);
+		} else if (!strcmp(c->path, path)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Moves a clip to the head of the LRU list.
+ */
+static void cache_touch(clip *c) {
+	if (c == clips)
+		return;
+	c->prev->next = c->next;
+	if (c->next) c->next->prev = c->prev;
+	c->prev = NULL;
+	c->next = clips;
+	clips->prev = c;
+	clips = c;
+}
+
+/*
+ * Allocates a clip of "size" data bytes at the head of the LRU list,
+ * freeing the least recently used clips not being played until it fits.
+ * Returns NULL when it does not.
+ */
+static clip *cache_alloc(const char *path, uint32_t size) {
+	size_t len = strlen(path) + 1;
+	size_t bytes = sizeof(clip) + size + len;
+	clip *c, *last;
+
+	if (!cacheReady) {
+		chHeapObjectInit(&cacheHeap, cachePool, sizeof(cachePool));
+		cacheReady = TRUE;
 	}
+	while ((c = chHeapAlloc(&cacheHeap, bytes)) == NULL) {
+		for (last = clips; last && last->next; last = last->next)
+			;
+		while (last && last->users)
+			last = last->prev;
+		if (!last)
+			return NULL;
+		cache_free(last);
+	}
+	cacheUsed += bytes;
+
+	c->data = (uint8_t*) (c + 1);
+	c->path = (char*) c->data + size;
+	memcpy(c->path, path, len);
+	c->size = size;
+	c->filled = 0;
+	c->epoch = cacheEpoch;
+	c->users = 0;
+	c->prev = NULL;
+	c->next = clips;
+	if (clips) clips->prev = c;
+	clips = c;
+	return c;
+}
+#endif
+
+#if PLAYER_VOICES > 0
+/*
+ * Opens a voice file and checks it can be mixed into the stream. A clip
+ * in the cache is played from RAM, a short one is stored while it plays.
+ */
+static bool open_voice(voice *v) {
+	waveInfo wi;
+#if PLAYER_CACHE_SIZE > 0
+	clip *c = cache_find(v->path);
+
+	v->clip = NULL;
+	v->inRam = FALSE;
+	if (c && c->filled == c->size) {
+		if (c->sampleRate != sampleRate) {
+#if DEBUG
+			chprintf((BaseSequentialStream*) &CONSOLE, "Error: %s cannot be mixed.\r\n", v->path);
+#endif
+			return FALSE;
+		}
+		cache_touch(c);
+		c->users++;
+		v->clip = c;
+		v->inRam = TRUE;
+		v->channels = c->channels;
+		v->width = c->width;
+		v->bytesLeft = c->size;
+		stats.cacheHits++;
+		return TRUE;
+	}
+	stats.cacheMisses++;
+#endif
+
+	if (fileSourceOpen(&v->file, v->path) != FR_OK)
+		return FALSE;
+	if (wave_parse_header(&v->file.src, hdrbuf, sizeof(hdrbuf), &wi) != WAVE_OK
+		|| wi.audioFormat != FORMAT_PCM || wi.sampleRate != sampleRate
+		|| wi.numChannels == 0 || wi.numChannels > 2
+		|| !(wi.bitsPerSample == 8 || wi.bitsPerSample == 16)
+		|| wi.blockAlign != wi.numChannels * (wi.bitsPerSample / 8)
+		|| srcSeek(&v->file.src, wi.dataOffset) != FR_OK) {
+#if DEBUG
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: %s cannot be mixed.\r\n", v->path);
+#endif
+		srcClose(&v->file.src);
+		return FALSE;
+	}
+	v->channels = (uint8_t) wi.numChannels;
+	v->width = (uint8_t) (wi.bitsPerSample / 8);
+	v->bytesLeft = wi.dataSize - wi.dataSize % wi.blockAlign;
+#if PLAYER_CACHE_SIZE > 0
+	// not while another voice is storing the same clip
+	if (!c && v->bytesLeft <= PLAYER_CACHE_CLIP
+		&& (c = cache_alloc(v->path, v->bytesLeft)) != NULL) {
+		c->sampleRate = wi.sampleRate;
+		c->channels = v->channels;
+		c->width = v->width;
+		c->users = 1;
+		v->clip = c;
+	}
+#endif
+	return TRUE;
+}
+
+static void free_voice(voice *v) {
+	chSysLock();
+	v->state = VOICE_FREE;
+	chSysUnlock();
+}
+
+/*
+ * Closes a playing voice. A clip it was storing is kept only when it was
+ * read to the end.
+ */
+static void close_voice(voice *v) {
+#if PLAYER_CACHE_SIZE > 0
+	clip *c = v->clip;
+
+	if (c) {
+		c->users--;
+		if (c->filled < c->size)
+			cache_free(c);
+		v->clip = NULL;
+	}
+	if (!v->inRam)
+		srcClose(&v->file.src);
+#else
+	srcClose(&v->file.src);
+#endif
+	free_voice(v);
+}
+
+/*
+ * Opens the voices handed over by playVoice(), closes the ones that are
+ * done. With "all" every voice is closed, at the end of the stream.
+ */
+static void update_voices(bool all) {
+	uint8_t i;
+
+	for (i = 0; i < PLAYER_VOICES; i++) {
+		voice *v = &voices[i];
+		if (v->state == VOICE_PLAYING && (all || !v->bytesLeft)) {
+			close_voice(v);
+		} else if (v->state == VOICE_PENDING) {
+			rtcnt_t start = chSysGetRealtimeCounterX();
+			if (all || v->stop || !open_voice(v)) {
+				free_voice(v);
+			} else {
+				v->state = VOICE_PLAYING;
+				stats.voiceOpenTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+			}
+		}
+	}
+}
+
+/*
+ * Drops the voices handed over after the stream ended, called with the
+ * lock held as the player exits.
+ */
+static void drop_voices(void) {
+	uint8_t i;
+
+	for (i = 0; i < PLAYER_VOICES; i++)
+		if (voices[i].state == VOICE_PENDING)
+			voices[i].state = VOICE_FREE;
+}
+
+/*
+ * Saturating add of a signed 16-bit scale sample to output sample k.
+ */
+static inline void mix_sample(uint8_t *out, size_t k, int32_t s) {
+	int32_t o;
+
+	if (bitsPerSample == 8) {
+		o = out[k] - 0x80 + (s >> 8);
+		if (o > 127) o = 127;
+		else if (o < -128) o = -128;
+		out[k] = (uint8_t) (o + 0x80);
+	} else {
+		o = (int16_t) (((uint16_t*) out)[k] ^ 0x8000) + s;
+		if (o > 32767) o = 32767;
+		else if (o < -32768) o = -32768;
+		((uint16_t*) out)[k] = (uint16_t) o ^ 0x8000;
+	}
+}
+
+static inline int32_t voice_sample(const uint8_t *p, uint8_t width) {
+	return width == 1 ? (p[0] - 0x80) << 8 : (int16_t) (p[0] | (p[1] << 8));
+}
+
+/*
+ * Adds "n" voice frames at "p" to the DAC frames at "out". With "fade"
+ * the gain falls to 0 over frames "first" to "fade" of the half.
+ */
+static void mix_block(const voice *v, const uint8_t *p, uint8_t *out, size_t n, int32_t g, size_t first, size_t fade) {
+	size_t i;
+
+	for (i = 0; i < n; i++, p += v->channels * v->width) {
+		int32_t l = voice_sample(p, v->width);
+		int32_t r = v->channels == 2 ? voice_sample(p + v->width, v->width) : l;
+		int32_t gi = fade ? g * (int32_t) (fade - first - i) / (int32_t) fade : g;
+		if (CODEC_CHANNELS == 1) {
+			mix_sample(out, i, (((l + r) >> 1) * gi) >> 15);
+		} else {
+			mix_sample(out, 2 * i, (l * gi) >> 15);
+			mix_sample(out, 2 * i + 1, (r * gi) >> 15);
+		}
+	}
+}
+
+/*
+ * Gets up to "n" frames of a voice, from its clip or read from its file,
+ * and points "src" at them. Returns the number of frames, fewer at the end
+ * of the data or on a read error.
+ */
+static size_t read_voice(voice *v, size_t n, const uint8_t **src) {
+	size_t fb = v->channels * v->width;
+	uint8_t *dst = voicebuf;
+	UINT br;
+
+	if (n > v->bytesLeft / fb) n = v->bytesLeft / fb;
+#if PLAYER_CACHE_SIZE > 0
+	if (v->clip) {
+		// straight from the clip, or read into its place in it
+		dst = v->clip->data + (v->clip->size - v->bytesLeft);
+		if (v->inRam) {
+			v->bytesLeft -= n * fb;
+			*src = dst;
+			return n;
+		}
+	}
+#endif
+	if (dst == voicebuf && n > sizeof(voicebuf) / fb) n = sizeof(voicebuf) / fb;
+	if (srcRead(&v->file.src, dst, n * fb, &br) != FR_OK || br < n * fb) {
+		n = br / fb;
+		v->bytesLeft = 0;
+	} else {
+		v->bytesLeft -= br;
+	}
+#if PLAYER_CACHE_SIZE > 0
+	if (v->clip)
+		v->clip->filled += br;
+#endif
+	*src = dst;
+	return n;
+}
+
+/*
+ * Mixes every playing voice into "frames" converted frames at "out".
+ */
+static void mix_voices(uint8_t *out, size_t frames) {
+	rtcnt_t start = chSysGetRealtimeCounterX();
+	uint32_t elapsed;
+	uint8_t i, mixed = 0;
+
+	for (i = 0; i < PLAYER_VOICES; i++) {
+		voice *v = &voices[i];
+		size_t done = 0, fade = 0;
+		// the stream volume applies to the voices too
+		int32_t g = (v->gain * gain) >> 15;
+
+		if (v->state != VOICE_PLAYING || !v->bytesLeft)
+			continue;
+		if (v->stop)
+			fade = frames;
+		while (done < frames && v->bytesLeft) {
+			const uint8_t *src;
+			size_t n = read_voice(v, frames - done, &src);
+			mix_block(v, src, out + done * outFrame, n, g, done, fade);
+			done += n;
+		}
+		if (fade)
+			v->bytesLeft = 0;
+		mixed++;
+	}
+
+	elapsed = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+	if (elapsed > stats.maxMix)
+		stats.maxMix = elapsed;
+	stats.voices = mixed;
+}
+#endif
+
+/*
+ * Fills one half of the DAC buffer with the next halfFrames frames of the
+ * data chunk, padding with mid-scale past the end of the data.
+ */
+static FRESULT fill_half(uint8_t *buf) {
+	size_t frames = outRate != sampleRate ? resample_input(&rs, halfFrames) : halfFrames;
+	size_t len = frames * blockAlign;
+	size_t pos = leadIn < len ? leadIn : len;
+	uint8_t *in = scratch ? scratch : buf;
+	UINT btr;
+	FRESULT err = FR_OK;
+
+	if (pos) {
+		fill_silence(in, pos);
+		leadIn -= pos;
+	}
+	while (pos < len) {
+		if (!data_left()) {
+			// carry on with the next file in the same half
+			if (!nxt) wait_opener();
+			if (!nxt || !is_gapless(nxt)) break;
+			srcClose(cur->src);
+			next_track();
+			stats.gapless++;
+		}
+#if !PLAYER_READ_AHEAD
+		// the read after the lead-in ends on the alignment instead
+		if (!pos && !codedAlign && srcTell(cur->src) % SECTOR_SIZE)
+			stats.unaligned++;
+#endif
+		if (codedAlign) {
+			err = read_adpcm(in + pos, len - pos, &btr);
+		} else if (g711) {
+			err = read_g711(in + pos, len - pos, &btr);
+		} else {
+			err = srcRead(cur->src, in + pos, len - pos < bytesToPlay ? len - pos : bytesToPlay, &btr);
+			bytesToPlay -= btr;
+		}
+		if (err != FR_OK) return err;
+		pos += btr;
+		if (!btr) bytesToPlay = 0;	// truncated file
+	}
+	if (pos < len)
+		fill_silence(in + pos, len - pos);
+	if (outRate != sampleRate) {
+		// convert in the scratch area, then interpolate into the half
+		convert(in, in, frames);
+#if PLAYER_VOICES > 0
+		mix_voices(in, frames);
+#endif
+		if (bitsPerSample == 8)
+			resample_u8(&rs, in, buf, halfFrames, CODEC_CHANNELS);
+		else
+			resample_u16(&rs, (uint16_t*) in, (uint16_t*) buf, halfFrames, CODEC_CHANNELS);
+	} else {
+		convert(in, buf, halfFrames);
+#if PLAYER_VOICES > 0
+		mix_voices(buf, halfFrames);
+#endif
+	}
+	return err;
+}
+
+/*
+ * Output level of frame f in a ramp from the DAC idle level up to
+ * mid-scale.
+ */
+static inline uint16_t ramp_level(size_t f) {
+	return (uint16_t) (((bitsPerSample == 8 ? 0x80U : 0x8000U) * f) / rampFrames);
+}
+
+/*
+ * Ramps up to mid-scale over the first frames of a half, which hold the
+ * lead-in silence.
+ */
+static void ramp_in(uint8_t *buf) {
+	size_t f;
+	uint8_t c;
+
+	for (f = 0; f < rampFrames; f++) {
+		uint16_t v = ramp_level(f);
+		for (c = 0; c < CODEC_CHANNELS; c++) {
+			if (bitsPerSample == 8)
+				buf[f * CODEC_CHANNELS + c] = (uint8_t) v;
+			else
+				((uint16_t*) buf)[f * CODEC_CHANNELS + c] = v;
+		}
+	}
+}
+
+/*
+ * Closing half: the audio fades to mid-scale over rampFrames frames, the
+ * output ramps down to the idle level over as many and stays there.
+ */
+static void ramp_out(uint8_t *buf) {
+	int32_t mid = bitsPerSample == 8 ? 0x80 : 0x8000;
+	size_t f;
+	uint8_t c;
+
+	for (f = 0; f < halfFrames; f++) {
+		for (c = 0; c < CODEC_CHANNELS; c++) {
+			size_t i = f * CODEC_CHANNELS + c;
+			int32_t v;
+			if (f < rampFrames) {
+				v = bitsPerSample == 8 ? buf[i] : ((uint16_t*) buf)[i];
+				v = mid + (v - mid) * (int32_t) (rampFrames - f) / (int32_t) rampFrames;
+			} else if (f < 2 * rampFrames) {
+				v = ramp_level(2 * rampFrames - f);
+			} else {
+				v = 0;
+			}
+			if (bitsPerSample == 8)
+				buf[i] = (uint8_t) v;
+			else
+				((uint16_t*) buf)[i] = (uint16_t) v;
+		}
+	}
+}
+
+/*
+ * Sets the buffer layout up for the current file and starts the DAC.
+ */
+static void setup_session(void) {
+	size_t i, scratchFrame = 0;
+
+	// nothing is playing, no need to ramp
+	gain = gainTarget;
+
+	outRate = sampleRate;
+	if (resample && !CODEC_RATE_EXACT(sampleRate)) {
+		for (i = 0; i < sizeof(resampleRates) / sizeof(resampleRates[0]); i++) {
+			if (resampleRates[i] > sampleRate && CODEC_RATE_EXACT(resampleRates[i])) {
+				outRate = resampleRates[i];
+				break;
+			}
+		}
+	}
+
+	// two halves of DAC frames, plus one half of file frames to read into
+	// when they are larger or to convert before resampling
+	outFrame = (bitsPerSample == 8 ? 1 : 2) * CODEC_CHANNELS;
+	if (blockAlign > outFrame)
+		scratchFrame = blockAlign;
+	else if (outRate != sampleRate)
+		scratchFrame = outFrame;
+	scratch = NULL;
+	coded = NULL;
+	halfFrames = (sizeof(dacbuffer) - codedAlign) / (2 * outFrame + scratchFrame);
+	halfFrames &= ~(size_t) (PLAYER_HALF_MIN - 1);
+	if (halfFrames > halfSize)
+		halfFrames = halfSize;
+	if (scratchFrame)
+		scratch = (uint8_t*) dacbuffer + 2 * halfFrames * outFrame;
+	if (codedAlign)
+		coded = (uint8_t*) dacbuffer + sizeof(dacbuffer) - codedAlign;
+	if (outRate != sampleRate)
+		resample_init(&rs, sampleRate, outRate, bitsPerSample == 8 ? 0x80 : 0x8000);
+
+	size_t unit = blockAlign;		// lead-in granularity
+	leadIn = 0;
+	alignSize = 0;
+#if PLAYER_STREAMING && !PLAYER_READ_AHEAD
+	// in file bytes, G.711 reads half the bytes it plays
+	size_t expand = g711 ? 2 : 1;
+	size_t len = halfFrames * blockAlign / expand;
+	size_t frame = blockAlign / expand;
+	// refills vary in length when resampling, ADPCM reads whole blocks
+	if (len % SECTOR_SIZE == 0 && outRate == sampleRate && !codedAlign) {
+		// align the refills to the half too when it divides the cluster,
+		// so that no refill straddles two clusters
+		size_t align = SECTOR_SIZE;
+		if (((size_t) MMC_FS.csize * SECTOR_SIZE) % len == 0)
+			align = len;
+		leadIn = srcTell(cur->src) % align;
+		if (leadIn % frame) {
+			leadIn = 0;
+		} else {
+			unit = (align % frame) ? len : align;
+			alignSize = align;
+			alignUnit = unit;
+		}
+		leadIn *= expand;
+		unit *= expand;
+	}
+#endif
+
+	// room for the ramp up in the lead-in, in whole alignment units so
+	// that the refills stay aligned
+	rampFrames = (size_t) outRate * PLAYER_RAMP_MS / 1000;
+	if (rampFrames > halfFrames / 2)
+		rampFrames = halfFrames / 2;
+	while (leadIn < rampFrames * blockAlign)
+		leadIn += unit;
+
+	stats.period = (uint32_t) ((uint64_t) halfFrames * 1000000 / outRate);
+	stats.outRate = outRate;
+
+	codec_init(bitsPerSample == 8 ? 8 : 16, CODEC_CHANNELS);
+}
+
+/*
+ * Plays from the current file on until the data runs out, following on
+ * gaplessly with queued files of the same format. Returns TRUE when all
+ * of it has been played out, FALSE when stopped or on a read error.
+ */
+static bool play_session(void) {
+	uint8_t *halves[2];
+	uint8_t next = 0;			// half to refill on the next DMA event
+	uint8_t closing = 0;		// 1: closing half queued, 2: idle half queued
+	uint8_t half;
+	uint32_t halfCount, lastCount = 0;
+	rtcnt_t start;
+	uint32_t elapsed;
+	bool first = stats.tracks == 1;
+	bool done = FALSE;
+
+	setup_session();
+	paused = FALSE;
+	halves[0] = (uint8_t*) dacbuffer;
+	halves[1] = halves[0] + halfFrames * outFrame;
+
+	if (fill_half(halves[0]) != FR_OK) goto end;
+	ramp_in(halves[0]);
+	if (first)
+		stats.firstReadTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+
+	if (prefetch) {
+		codec_audio_send(outRate, (dacsample_t*) dacbuffer, halfFrames * 2);
+		if (first)
+			stats.startTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+	}
+	if (fill_half(halves[1]) != FR_OK) goto end;
+	if (prefetch) {
+		// the DMA reached the second half before it was read
+		if (codec_half_count(NULL) != 0)
+			stats.underruns++;
+	} else {
+		codec_audio_send(outRate, (dacsample_t*) dacbuffer, halfFrames * 2);
+		if (first)
+			stats.startTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+	}
+#if PLAYER_READ_AHEAD
+	// the ring starts out empty, from here on an empty ring is late data
+	if (first)
+		readerResetStats();
+#endif
+
+	while (TRUE) {
+		// a stop request only wakes the player up, the closing half goes
+		// in at the next refill
+		eventmask_t evt = chEvtWaitAny(ALL_EVENTS);
+
+	    if (evt & EVT_DAC_ERR) break;
+		if ((evt & EVT_PLAYER_PAUSE) && !paused && !closing) {
+			codec_pause();
+			paused = TRUE;
+		}
+		if ((evt & EVT_PLAYER_RESUME) && paused) {
+			codec_resume();
+			paused = FALSE;
+		}
+		if (paused && chThdShouldTerminateX()) {
+			// the DMA holds inside half "next", the queued one closes
+			ramp_out(halves[next ^ 1]);
+			closing = 1;
+			codec_resume();
+			paused = FALSE;
+		}
+		if ((evt & EVT_PLAYER_SEEK) && !closing) {
+			uint32_t pos = align_offset(data_offset(&cur->info, seekTime));
+			if (srcSeek(cur->src, cur->info.dataOffset + pos) != FR_OK) break;
+			bytesToPlay = data_size(&cur->info) - pos;
+			ima.left = 0;
+		}
+	    if (evt & EVT_DAC_TC) {
+			start = chSysGetRealtimeCounterX();
+			halfCount = codec_half_count(&half);
+			// more than one half completed or not the half we are about to
+			// refill: the DMA has already played stale data. Refill the half
+			// that just completed, the other one is playing, or every refill
+			// from here on would land in the half the DMA is in.
+			if (halfCount - lastCount > 1 || half != next) {
+				stats.underruns++;
+				next = half;
+			}
+			lastCount = halfCount;
+
+			// the closing half has been played out, the DMA is on the
+			// idle half
+			if (closing == 2) {
+				done = !chThdShouldTerminateX();
+				break;
+			}
+
+			// a file still being opened may follow on gaplessly
+			if (!data_left() && !nxt)
+				wait_opener();
+			if (closing == 1) {
+				memset(halves[next], 0, halfFrames * outFrame);
+				closing = 2;
+			} else if (chThdShouldTerminateX() || (!data_left() && !(nxt && is_gapless(nxt)))) {
+				if (fill_half(halves[next]) != FR_OK) break;
+				ramp_out(halves[next]);
+				closing = 1;
+			} else {
+				if (fill_half(halves[next]) != FR_OK) break;
+			}
+			next ^= 1;
+
+			elapsed = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+			stats.refills++;
+			if (elapsed > stats.maxRefill)
+				stats.maxRefill = elapsed;
+			// the DMA wrapped into this half before the refill completed
+			if (codec_half_count(NULL) != lastCount)
+				stats.underruns++;
+			else if (elapsed > stats.period / 2)
+				stats.late++;
+
+			// get the next file ready while the player waits
+			open_ahead();
+#if PLAYER_VOICES > 0
+			update_voices(FALSE);
+#endif
+		}
+	}
+
+end:
+	codec_stop();
+#if PLAYER_VOICES > 0
+	update_voices(TRUE);
+#endif
+	if (chThdShouldTerminateX())
+		stats.stopTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - stopStart);
+	return done;
+}
+
+/*
+ * Plays a sound from the bank. Returns TRUE when it has been played out,
+ * FALSE when stopped or on a DMA error.
+ */
+static bool play_bank(const bankSound *s) {
+	bool done = FALSE;
+
+	paused = FALSE;
+	stats.tracks++;
+	stats.outRate = s->sampleRate;
+	stats.period = (uint32_t) ((uint64_t) (s->frames / 2) * 1000000 / s->sampleRate);
+	codec_init(s->bitsPerSample, CODEC_CHANNELS);
+	codec_audio_send(s->sampleRate, (dacsample_t*) s->data, s->frames);
+	stats.startTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+
+	while (TRUE) {
+		eventmask_t evt = chEvtWaitAny(ALL_EVENTS);
+
+		if ((evt & EVT_DAC_ERR) || chThdShouldTerminateX()) break;
+		if ((evt & EVT_PLAYER_PAUSE) && !paused) {
+			codec_pause();
+			paused = TRUE;
+		}
+		if ((evt & EVT_PLAYER_RESUME) && paused) {
+			codec_resume();
+			paused = FALSE;
+		}
+		// both halves played, the DMA is back at the idle level
+		if ((evt & EVT_DAC_TC) && codec_half_count(NULL) >= 2) {
+			done = TRUE;
+			break;
+		}
+	}
+
+	codec_stop();
+	if (chThdShouldTerminateX())
+		stats.stopTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - stopStart);
+	chSysLock();
+	bank = NULL;
+	chSysUnlock();
+	return done;
+}
+
+static THD_WORKING_AREA(waPlayerThread, PLAYER_STACK_SIZE);
+static THD_FUNCTION(wavePlayerThread, arg) {
+	chRegSetThreadName("player");
+
+	// a sound from the bank goes first, files queued meanwhile follow it
+	if (arg && !play_bank((const bankSound*) arg))
+		goto exit;
+
+	while (TRUE) {
+		// a file of another format, or queued too late to follow on
+		// gaplessly, restarts the DAC
+		wait_opener();
+		while (!nxt && !open_next()) {
+			chSysLock();
+			if (chMBGetUsedCountI(&playlist) == 0) {
+				// from here on queueFile() starts a new player
+#if PLAYER_VOICES > 0
+				drop_voices();
+#endif
+				playerThread = NULL;
+				chThdExitS((msg_t) 0);
+			}
+			chSysUnlock();
+		}
+		next_track();
+		if (!play_session()) break;
+		srcClose(cur->src);
+	}
+
+	srcClose(cur->src);
+	wait_opener();
+	if (nxt) {
+		srcClose(nxt->src);
+		nxt = NULL;
+	}
+
+exit:
+	chSysLock();
+#if PLAYER_VOICES > 0
+	drop_voices();
+#endif
+	playerThread = NULL;
+	chThdExitS((msg_t) 0);
+}
+
+/*
+ * Parses the header of an opened track, moves "ms" into its data and
+ * starts the player on it.
+ */
+static void start_track(track *t, uint32_t ms) {
+	// one sector read at offset 0 normally holds every chunk header up to
+	// the data, it goes straight into the DAC buffer
+	if (!parse_track(t, (uint8_t*) dacbuffer, SECTOR_SIZE)) return;
+	if (ms) {
+		t->startPos = data_offset(&t->info, ms);
+		if (srcSeek(t->src, t->info.dataOffset + t->startPos) != FR_OK) {
+			srcClose(t->src);
+			return;
+		}
+	}
+	stats.headerTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+
+	cur = &tracks[1];
+	nxt = t;
+	// published before the player can run, it clears playerThread as it
+	// exits, in one locked section
+	chSysLock();
+	playerThread = chThdCreateI(waPlayerThread, sizeof(waPlayerThread), PLAYER_PRIO, wavePlayerThread, NULL);
+	chSchWakeupS(playerThread, MSG_OK);
+	chSysUnlock();
+}
+
+void playFile(char* fpath) {
+	playFileAt(fpath, 0);
+}
+
+/*
+ * Plays a file from "ms" milliseconds into its data.
+ */
+void playFileAt(char* fpath, uint32_t ms) {
+	if (!fs_ready) {
+#if DEBUG
+	    chprintf((BaseSequentialStream*) &CONSOLE, "File System not mounted\r\n");
+#endif
+	    return;
+	}
+
+	stopPlay();
+
+	playStart = chSysGetRealtimeCounterX();
+	memset(&stats, 0, sizeof(stats));
+
+	track *t = &tracks[0];
+	if (!open_file(t, fpath)) return;
+	stats.openTime = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - playStart);
+	start_track(t, ms);
+}
+
+/*
+ * Plays a wave file from any source, e.g. memory or a serial link. The
+ * player closes the source when done with it. Files queued meanwhile
+ * follow it.
+ */
+void playSource(waveSource *src) {
+	stopPlay();
+
+	playStart = chSysGetRealtimeCounterX();
+	memset(&stats, 0, sizeof(stats));
+
+	tracks[0].src = src;
+	start_track(&tracks[0], 0);
+}
+
+/*
+ * Plays a sound from the bank in flash, which needs no card. Returns
+ * FALSE when there is no sound of that name or it was packed for another
+ * number of DAC channels.
+ */
+bool playSound(const char* name) {
+	const bankSound *s;
+
+	for (s = soundBank; s->name && strcmp(s->name, name); s++)
+		;
+	if (!s->name || s->channels != CODEC_CHANNELS) {
+#if DEBUG
+		chprintf((BaseSequentialStream*) &CONSOLE, "Error: no sound %s in the bank\r\n", name);
+#endif
+		return FALSE;
+	}
+
+	stopPlay();
+
+	playStart = chSysGetRealtimeCounterX();
+	memset(&stats, 0, sizeof(stats));
+
+	nxt = NULL;
+	chSysLock();
+	bank = s;
+	playerThread = chThdCreateI(waPlayerThread, sizeof(waPlayerThread), PLAYER_PRIO, wavePlayerThread, (void*) s);
+	chSchWakeupS(playerThread, MSG_OK);
+	chSysUnlock();
+	return TRUE;
+}
+
+/*
+ * Appends a file to the playlist, or plays it straight away when nothing
+ * is playing. Returns FALSE when the playlist is full or the path too long.
+ */
+bool queueFile(char* fpath) {
+	size_t slot;
+	msg_t res = MSG_TIMEOUT;
+
+	if (strlen(fpath) >= PLAYER_PATH_LEN)
+		return FALSE;
+
+	chSysLock();
+	for (slot = 0; slot < PLAYER_QUEUE_LEN && queueUsed[slot]; slot++)
+		;
+	if (slot < PLAYER_QUEUE_LEN)
+		queueUsed[slot] = TRUE;
+	chSysUnlock();
+	if (slot == PLAYER_QUEUE_LEN)
+		return FALSE;
+
+	strcpy(queuePaths[slot], fpath);
+	chSysLock();
+	// the player checks the playlist under the lock before it exits
+	if (playerThread)
+		res = chMBPostI(&playlist, (msg_t) slot);
+	if (res != MSG_OK)
+		queueUsed[slot] = FALSE;
+	chSysUnlock();
+
+	if (res == MSG_OK)
+		return TRUE;
+	if (playerThread)
+		return FALSE;
+	playFile(fpath);
+	return playerThread != NULL;
+}
+
+/*
+ * Number of files waiting in the playlist, not counting the one opened
+ * ahead.
+ */
+size_t getQueueCount(void) {
+	size_t n;
+
+	chSysLock();
+	n = (size_t) chMBGetUsedCountI(&playlist);
+	chSysUnlock();
+	return n;
+}
+
+/*
+ * Moves the file being played to "ms" milliseconds into its data.
+ */
+void seekPlay(uint32_t ms) {
+	chSysLock();
+	if (playerThread) {
+		seekTime = ms;
+		chEvtSignalI(playerThread, EVT_PLAYER_SEEK);
+	}
+	chSysUnlock();
+}
+
+void pausePlay(void) {
+	chSysLock();
+	if (playerThread)
+		chEvtSignalI(playerThread, EVT_PLAYER_PAUSE);
+	chSysUnlock();
+}
+
+void resumePlay(void) {
+	chSysLock();
+	if (playerThread)
+		chEvtSignalI(playerThread, EVT_PLAYER_RESUME);
+	chSysUnlock();
+}
+
+bool isPaused(void) {
+	return playerThread && paused;
+}
+
+/*
+ * Read position in the file being played, ms. The DAC is up to two half
+ * buffers behind it. For a sound from the bank, the DMA position rounded
+ * down to a half.
+ */
+uint32_t getPlayPosition(void) {
+	const bankSound *s;
+	uint32_t rate, done;
+
+	if (!playerThread)
+		return 0;
+	chSysLock();
+	s = bank;
+	chSysUnlock();
+	if (s) {
+		// halves completed by the DMA
+		done = codec_half_count(NULL) * (s->frames / 2);
+		if (done > s->frames) done = s->frames;
+		return (uint32_t) ((uint64_t) done * 1000 / s->sampleRate);
+	}
+
+	chSysLock();
+	rate = cur->info.byteRate ? cur->info.byteRate : cur->info.sampleRate * cur->info.blockAlign;
+	done = data_size(&cur->info) - bytesToPlay;
+	chSysUnlock();
+	return rate ? (uint32_t) ((uint64_t) done * 1000 / rate) : 0;
+}
+
+void stopPlay(void) {
+	thread_t *tp = playerThread;
+	msg_t slot;
+
+	// the player clears playerThread itself on exit, keep our reference
+	if (tp) {
+		stopStart = chSysGetRealtimeCounterX();
+		chThdTerminate(tp);
+		chEvtSignal(tp, EVT_PLAYER_STOP);
+		chThdWait(tp);
+		playerThread = NULL;
+	}
+
+	chSysLock();
+	while (chMBFetchI(&playlist, &slot) == MSG_OK)
+		queueUsed[slot] = FALSE;
+	chSysUnlock();
+}
+
+void setPrefetch(bool on) {
+	prefetch = on;
+}
+
+bool getPrefetch(void) {
+	return prefetch;
+}
+
+/*
+ * Q15 gain of a volume in percent: the square of it, a rough audio taper.
+ */
+static int32_t percent_gain(uint8_t percent) {
+	if (percent > 100) percent = 100;
+	return (int32_t) percent * percent * GAIN_UNITY / 10000;
+}
+
+/*
+ * Sets the volume in percent of full scale. The gain follows the square
+ * of it, a rough audio taper, and ramps to the new value while playing.
+ */
+void setVolume(uint8_t percent) {
+	if (percent > 100) percent = 100;
+	volume = percent;
+	gainTarget = percent_gain(percent);
+}
+
+/*
+ * Mixes a file over the stream being played at "percent" volume, scaled
+ * by the stream volume. Returns the voice number, -1 when nothing is
+ * playing, all voices are busy or the path is too long. Files that cannot
+ * be mixed, see open_voice(), are dropped when the player opens them.
+ */
+int playVoice(char* fpath, uint8_t percent) {
+#if PLAYER_VOICES > 0
+	int i;
+
+	if (strlen(fpath) >= PLAYER_PATH_LEN)
+		return -1;
+	chSysLock();
+	if (!playerThread || bank) {
+		chSysUnlock();
+		return -1;
+	}
+	for (i = 0; i < PLAYER_VOICES && voices[i].state != VOICE_FREE; i++)
+		;
+	if (i < PLAYER_VOICES) {
+		// the player does not look at a free voice, fill it in first
+		strcpy(voices[i].path, fpath);
+		voices[i].gain = percent_gain(percent);
+		voices[i].stop = FALSE;
+		voices[i].state = VOICE_PENDING;
+	}
+	chSysUnlock();
+	return i < PLAYER_VOICES ? i : -1;
+#else
+	(void) fpath;
+	(void) percent;
+	return -1;
+#endif
+}
+
+/*
+ * Fades a voice out and closes it.
+ */
+void stopVoice(int n) {
+#if PLAYER_VOICES > 0
+	if (n >= 0 && n < PLAYER_VOICES)
+		voices[n].stop = TRUE;
+#else
+	(void) n;
+#endif
+}
+
+/*
+ * Number of voices playing or about to.
+ */
+size_t getVoiceCount(void) {
+	size_t n = 0;
+#if PLAYER_VOICES > 0
+	int i;
+
+	for (i = 0; i < PLAYER_VOICES; i++)
+		if (voices[i].state != VOICE_FREE)
+			n++;
+#endif
+	return n;
+}
+
+size_t getVoiceMax(void) {
+	return PLAYER_VOICES;
+}
+
+/*
+ * Drops every clip in the sample cache, the ones being played once their
+ * voices end.
+ */
+void flushSampleCache(void) {
+#if PLAYER_CACHE_SIZE > 0
+	chSysLock();
+	cacheEpoch++;
+	chSysUnlock();
+#endif
+}
+
+uint8_t getVolume(void) {
+	return volume;
+}
+
+/*
+ * Enables resampling of the rates the DAC timer cannot play exactly,
+ * from the next playFile().
+ */
+void setResample(bool on) {
+	resample = on;
+}
+
+bool getResample(void) {
+	return resample;
+}
+
+/*
+ * Sets the number of frames per half buffer used from the next playFile().
+ * Files with more channels than the DAC may get fewer frames per half.
+ * Returns the size actually set: rounded down to PLAYER_HALF_MIN and
+ * clamped to [PLAYER_HALF_MIN, PLAYER_HALF_MAX].
+ */
+size_t setHalfSize(size_t samples) {
+	samples &= ~(size_t) (PLAYER_HALF_MIN - 1);
+	if (samples < PLAYER_HALF_MIN) samples = PLAYER_HALF_MIN;
+	if (samples > PLAYER_HALF_MAX) samples = PLAYER_HALF_MAX;
+	halfSize = samples;
+	return halfSize;
+}
+
+size_t getHalfSize(void) {
+	return halfSize;
+}
+
+size_t getHalfSizeMax(void) {
+	return PLAYER_HALF_MAX;
+}
+
+void getWaveInfo(waveInfo *wi) {
+	chSysLock();
+	*wi = cur->info;
+	chSysUnlock();
+}
+
+void getPlayerStats(playerStats *st) {
+	chSysLock();
+	*st = stats;
+#if PLAYER_CACHE_SIZE > 0
+	st->cacheUsed = cacheUsed;
+#endif
+	st->cacheSize = PLAYER_CACHE_SIZE;
+	chSysUnlock();
+#if PLAYER_READ_AHEAD
+	readerStats rd;
+	readerGetStats(&rd);
+	st->aheadSlots = rd.slots;
+	st->aheadLow = rd.low;
+	st->aheadHigh = rd.high;
+	st->aheadWaits = rd.waits;
+	st->maxCardRead = rd.maxRead;
+#endif
 }
@@ -6,6 +6,39 @@
 #define WAVEPLAYER_H_
 
 #include "ch.h"
+#include "waveHeader.h"
+
+typedef struct _playerStats
+{
+	uint32_t	refills;		// half buffers refilled this session
+	uint32_t	underruns;		// DMA wrapped into the half being refilled
+	uint32_t	late;			// refills that used more than half of the period
+	uint32_t	unaligned;		// refills whose read did not start on a sector, 0 with read-ahead
+	uint32_t	maxRefill;		// worst-case refill time, us
+	uint32_t	period;			// half buffer play time, us
+	uint32_t	outRate;		// DAC rate, differs from the file's when resampling
+	uint32_t	clmtUsed;		// link map words needed by the file
+	uint32_t	clmtSize;		// link map words available, 0 if disabled
+	uint32_t	openTime;		// start-up timestamps, us since playFile():
+	uint32_t	headerTime;		//   file opened, header parsed,
+	uint32_t	firstReadTime;	//   first half read,
+	uint32_t	startTime;		//   DMA started
+	uint32_t	stopTime;		// stopPlay() to DAC off, us
+	uint32_t	tracks;			// files played this session
+	uint32_t	gapless;		// files that followed on without stopping the DMA
+	uint32_t	maxMix;			// worst-case time mixing the voices into a half, us
+	uint32_t	voices;			// voices mixed into the last half
+	uint32_t	voiceOpenTime;	// last voice started, us from open to ready
+	uint32_t	cacheHits;		// voices played from the sample cache
+	uint32_t	cacheMisses;	// voices read from the card
+	uint32_t	cacheUsed;		// sample cache bytes in use
+	uint32_t	cacheSize;		// sample cache bytes, 0 if disabled
+	uint32_t	aheadSlots;		// read-ahead ring depth, 0 if disabled
+	uint32_t	aheadLow;		// low-water mark of the ring while reading, slots
+	uint32_t	aheadHigh;		// high-water mark of the ring, slots
+	uint32_t	aheadWaits;		// refills that found the ring empty
+	uint32_t	maxCardRead;	// longest read into the ring, us
+} playerStats;
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,7 +47,33 @@ extern "C" {
 extern thread_t* playerThread;
 
 void playFile(char* fpath);
+void playFileAt(char* fpath, uint32_t ms);
+void playSource(waveSource *src);
+bool playSound(const char* name);
 void stopPlay(void);
+void seekPlay(uint32_t ms);
+void pausePlay(void);
+void resumePlay(void);
+bool isPaused(void);
+uint32_t getPlayPosition(void);
+bool queueFile(char* fpath);
+size_t getQueueCount(void);
+int playVoice(char* fpath, uint8_t percent);
+void stopVoice(int n);
+size_t getVoiceCount(void);
+size_t getVoiceMax(void);
+void flushSampleCache(void);
+void getPlayerStats(playerStats *stats);
+void getWaveInfo(waveInfo *info);
+void setPrefetch(bool on);
+bool getPrefetch(void);
+void setVolume(uint8_t percent);
+uint8_t getVolume(void);
+void setResample(bool on);
+bool getResample(void);
+size_t setHalfSize(size_t samples);
+size_t getHalfSize(void);
+size_t getHalfSizeMax(void);
 
 #ifdef __cplusplus
 }
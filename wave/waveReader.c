@@ -0,0 +1,274 @@
+/*
+ * waveReader.c
+ *
+ * Reader thread and ring of the read-ahead. The reader fills the slot
+ * after the last filled one while one is free, the player empties them in
+ * order; slots hold the offset and length of what they were read from and
+ * the ring state is only touched under the kernel lock. A seek drops the
+ * whole ring, a read in progress is then thrown away when it completes.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "waveReader.h"
+#include <string.h>
+
+#define SECTOR_SIZE		512
+
+typedef struct {
+	readerSource	*owner;
+	uint16_t	len;
+	uint16_t	off;				// bytes taken by the player
+	uint32_t	data[READER_SLOT_SIZE / 4];
+} slot;
+
+static slot ring[READER_SLOTS];
+static size_t head;					// next slot to take
+static size_t count;				// filled slots from head on
+static uint32_t gen;				// bumped when the ring is dropped
+
+static readerSource *sources;		// in reading order
+static readerSource *busy;			// being read into the ring
+static thread_t *reader;
+static thread_reference_t readerWait;
+static thread_reference_t dataWait;
+static thread_reference_t closeWait;
+
+static readerStats stats;
+static bool primed;					// the ring has been full since the last drop
+
+/*
+ * First source with data left to read.
+ */
+static readerSource *to_read(void) {
+	readerSource *rs;
+
+	for (rs = sources; rs && rs->fill >= rs->end; rs = rs->next)
+		;
+	return rs;
+}
+
+/*
+ * Empties the ring, the sources read from where the player is.
+ */
+static void drop_ring(void) {
+	readerSource *rs;
+
+	count = 0;
+	gen++;
+	primed = FALSE;
+	for (rs = sources; rs; rs = rs->next)
+		rs->fill = rs->pos;
+	chThdResumeI(&readerWait, MSG_OK);
+}
+
+static THD_WORKING_AREA(waReaderThread, READER_STACK_SIZE);
+static THD_FUNCTION(readerThread, arg) {
+	(void) arg;
+	chRegSetThreadName("reader");
+
+	while (TRUE) {
+		readerSource *rs = NULL;
+		slot *s;
+		uint32_t g;
+		DWORD ofs;
+		UINT btr, br = 0;
+		FRESULT err = FR_OK;
+		rtcnt_t start;
+
+		chSysLock();
+		while (count == READER_SLOTS || (rs = to_read()) == NULL)
+			chThdSuspendS(&readerWait);
+		s = &ring[(head + count) % READER_SLOTS];
+		busy = rs;
+		g = gen;
+		ofs = rs->fill;
+		chSysUnlock();
+
+		// up to the next sector boundary, whole sectors from then on
+		btr = READER_SLOT_SIZE - ofs % SECTOR_SIZE;
+		if (btr > rs->end - ofs)
+			btr = rs->end - ofs;
+		start = chSysGetRealtimeCounterX();
+		if (srcTell(rs->in) != ofs)
+			err = srcSeek(rs->in, ofs);
+		if (err == FR_OK)
+			err = srcRead(rs->in, s->data, btr, &br);
+		uint32_t elapsed = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - start);
+
+		chSysLock();
+		busy = NULL;
+		if (g == gen) {
+			if (elapsed > stats.maxRead)
+				stats.maxRead = elapsed;
+			if (br) {
+				s->owner = rs;
+				s->len = (uint16_t) br;
+				s->off = 0;
+				rs->fill += br;
+				count++;
+				if (count > stats.high)
+					stats.high = count;
+				if (count == READER_SLOTS)
+					primed = TRUE;
+				chThdResumeI(&dataWait, MSG_OK);
+			}
+			if (err != FR_OK || br < btr) {
+				// error or truncated file: the player gets what was read
+				rs->err = err;
+				rs->end = rs->fill;
+				chThdResumeI(&dataWait, MSG_OK);
+			}
+		}
+		chThdResumeI(&closeWait, MSG_OK);
+		chSysUnlock();
+	}
+}
+
+static FRESULT ahead_read(waveSource *src, void *buf, UINT btr, UINT *br) {
+	readerSource *rs = (readerSource*) src;
+	uint8_t *p = buf;
+	UINT n = 0;
+	FRESULT err = FR_OK;
+
+	chSysLock();
+	while (n < btr) {
+		slot *s = &ring[head];
+		if (count && s->owner == rs) {
+			UINT len = s->len - s->off;
+			if (len > btr - n)
+				len = btr - n;
+			// only this thread frees or drops slots
+			chSysUnlock();
+			memcpy(p + n, (uint8_t*) s->data + s->off, len);
+			chSysLock();
+			s->off += len;
+			rs->pos += len;
+			n += len;
+			if (s->off == s->len) {
+				head = (head + 1) % READER_SLOTS;
+				count--;
+				if (primed && to_read() && count < stats.low)
+					stats.low = count;
+				chThdResumeI(&readerWait, MSG_OK);
+			}
+		} else if (count || rs->fill >= rs->end) {
+			// all of it taken, the ring holds the next source
+			err = rs->err;
+			break;
+		} else {
+			stats.waits++;
+			if (primed)
+				stats.low = 0;
+			chThdSuspendS(&dataWait);
+		}
+	}
+	chSysUnlock();
+	*br = n;
+	return err;
+}
+
+static FRESULT ahead_seek(waveSource *src, DWORD ofs) {
+	readerSource *rs = (readerSource*) src;
+
+	chSysLock();
+	rs->pos = ofs < rs->end ? ofs : rs->end;
+	rs->err = FR_OK;
+	drop_ring();
+	chSysUnlock();
+	return FR_OK;
+}
+
+static DWORD ahead_tell(waveSource *src) {
+	return ((readerSource*) src)->pos;
+}
+
+static DWORD ahead_size(waveSource *src) {
+	return srcSize(((readerSource*) src)->in);
+}
+
+static void ahead_close(waveSource *src) {
+	readerSource *rs = (readerSource*) src;
+	readerSource **pp;
+	size_t i;
+
+	chSysLock();
+	for (pp = &sources; *pp && *pp != rs; pp = &(*pp)->next)
+		;
+	if (*pp)
+		*pp = rs->next;
+	// its slots are the first ones unless it is closed out of order
+	while (count && ring[head].owner == rs) {
+		head = (head + 1) % READER_SLOTS;
+		count--;
+	}
+	for (i = 0; i < count; i++)
+		if (ring[(head + i) % READER_SLOTS].owner == rs)
+			break;
+	if (i < count)
+		drop_ring();
+	chThdResumeI(&readerWait, MSG_OK);
+	// the reader may not touch the source once closed, what it is
+	// reading for it is thrown away
+	if (busy == rs) {
+		gen++;
+		while (busy == rs)
+			chThdSuspendS(&closeWait);
+	}
+	chSysUnlock();
+
+	srcClose(rs->in);
+}
+
+static const struct waveSourceVMT aheadVMT = {
+	ahead_read, ahead_seek, ahead_tell, ahead_size, ahead_close
+};
+
+/*
+ * Reads "in" ahead from where it is up to offset "end", after the sources
+ * opened before. Closing "rs" closes "in".
+ */
+void readerOpen(readerSource *rs, waveSource *in, DWORD end) {
+	rs->src.vmt = &aheadVMT;
+	rs->in = in;
+	rs->pos = srcTell(in);
+	rs->fill = rs->pos;
+	rs->end = end;
+	rs->err = FR_OK;
+	rs->next = NULL;
+
+	chSysLock();
+	readerSource **pp;
+	for (pp = &sources; *pp; pp = &(*pp)->next)
+		;
+	*pp = rs;
+	if (!reader) {
+		stats.low = READER_SLOTS;
+		reader = chThdCreateI(waReaderThread, sizeof(waReaderThread), READER_PRIO, readerThread, NULL);
+		chSchWakeupS(reader, MSG_OK);
+	} else {
+		chThdResumeI(&readerWait, MSG_OK);
+	}
+	chSysUnlock();
+}
+
+void readerGetStats(readerStats *st) {
+	chSysLock();
+	*st = stats;
+	st->slots = READER_SLOTS;
+	st->level = count;
+	chSysUnlock();
+}
+
+/*
+ * Starts the marks over, e.g. for a new session.
+ */
+void readerResetStats(void) {
+	chSysLock();
+	memset(&stats, 0, sizeof(stats));
+	stats.low = READER_SLOTS;
+	stats.high = count;
+	primed = count == READER_SLOTS;
+	chSysUnlock();
+}
@@ -0,0 +1,90 @@
+/*
+ * waveReader.h
+ *
+ * Read-ahead: a reader thread reads the data of the sources handed to it
+ * into a ring of slots ahead of the player, which then takes its refills
+ * from RAM. A slow card access, e.g. the card erasing blocks internally
+ * for 100 ms or more, eats into the data buffered in the ring instead of
+ * into the half period of a refill.
+ *
+ * A readerSource wraps the source of a track and is a source itself, read
+ * with srcRead() as any other. Sources are read ahead in the order they
+ * were opened: the next file of the playlist follows on in the ring once
+ * the reader reaches the end of the current data. FatFs must be built
+ * reentrant, the player and the shell use the card meanwhile.
+ */
+
+#ifndef WAVEREADER_H_
+#define WAVEREADER_H_
+
+#include "waveSource.h"
+
+/*
+ * Ring size: READER_SLOTS slots of READER_SLOT_SIZE bytes, a multiple of
+ * the sector size. Each slot is one card read, sector aligned but for the
+ * first of a file.
+ */
+#if !defined(READER_SLOTS)
+#if defined(STM32F1XX_HD)
+#define READER_SLOTS		16
+#else
+#define READER_SLOTS		4
+#endif
+#endif
+
+#if !defined(READER_SLOT_SIZE)
+#define READER_SLOT_SIZE	1024
+#endif
+
+// below the player, which must preempt it to refill in time
+#if !defined(READER_PRIO)
+#define READER_PRIO			NORMALPRIO
+#endif
+
+/*
+ * Reader thread stack. It runs f_read and f_lseek through the link map
+ * down to the card driver's block reads, as deep as the player's file
+ * calls, so it gets the same default as PLAYER_STACK_SIZE. Check it with
+ * the free column of the shell's threads command.
+ */
+#if !defined(READER_STACK_SIZE)
+#define READER_STACK_SIZE	1024
+#endif
+
+#if READER_SLOTS < 2 || READER_SLOT_SIZE % 512
+#error "READER_SLOTS must be 2 or more, READER_SLOT_SIZE a multiple of 512"
+#endif
+
+typedef struct _readerSource
+{
+	waveSource	src;
+	waveSource	*in;				// source read ahead
+	DWORD		pos;				// offset of the next srcRead()
+	DWORD		fill;				// offset of the next read into the ring
+	DWORD		end;				// no reads past this offset
+	FRESULT		err;				// read error, reported once the ring is empty
+	struct _readerSource *next;		// read ahead after this one
+} readerSource;
+
+typedef struct _readerStats
+{
+	uint32_t	slots;				// ring depth
+	uint32_t	level;				// slots filled now
+	uint32_t	low;				// low-water mark once the ring was full
+	uint32_t	high;				// high-water mark
+	uint32_t	waits;				// reads that found the ring empty
+	uint32_t	maxRead;			// longest slot read, us
+} readerStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void readerOpen(readerSource *rs, waveSource *in, DWORD end);
+void readerGetStats(readerStats *st);
+void readerResetStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WAVEREADER_H_ */
@@ -0,0 +1,184 @@
+/*
+ * waveSource.c
+ *
+ * File, memory and serial implementations of the player's byte source.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "waveSource.h"
+#include <string.h>
+
+/*
+ * FatFs file.
+ */
+static volatile size_t filesOpen;		// file sources open, see fileSourceCount()
+
+static FRESULT file_read(waveSource *src, void *buf, UINT btr, UINT *br) {
+	return f_read(&((fileSource*) src)->file, buf, btr, br);
+}
+
+static FRESULT file_seek(waveSource *src, DWORD ofs) {
+	return f_lseek(&((fileSource*) src)->file, ofs);
+}
+
+static DWORD file_tell(waveSource *src) {
+	return f_tell(&((fileSource*) src)->file);
+}
+
+static DWORD file_size(waveSource *src) {
+	return f_size(&((fileSource*) src)->file);
+}
+
+static void file_close(waveSource *src) {
+	f_close(&((fileSource*) src)->file);
+	chSysLock();
+	filesOpen--;
+	chSysUnlock();
+}
+
+static const struct waveSourceVMT fileVMT = {
+	file_read, file_seek, file_tell, file_size, file_close
+};
+
+FRESULT fileSourceOpen(fileSource *fs, const char *path) {
+	FRESULT err;
+
+	fs->src.vmt = &fileVMT;
+	err = f_open(&fs->file, path, FA_READ);
+	if (err == FR_OK) {
+		chSysLock();
+		filesOpen++;
+		chSysUnlock();
+	}
+	return err;
+}
+
+/*
+ * Number of file sources open, i.e. whether the card is being read from
+ * by the player, its voices or its reader. Can be called from an ISR.
+ */
+size_t fileSourceCount(void) {
+	return filesOpen;
+}
+
+/*
+ * Memory.
+ */
+static FRESULT mem_read(waveSource *src, void *buf, UINT btr, UINT *br) {
+	memSource *ms = (memSource*) src;
+
+	if (btr > ms->size - ms->pos)
+		btr = ms->size - ms->pos;
+	memcpy(buf, ms->data + ms->pos, btr);
+	ms->pos += btr;
+	*br = btr;
+	return FR_OK;
+}
+
+static FRESULT mem_seek(waveSource *src, DWORD ofs) {
+	memSource *ms = (memSource*) src;
+
+	// as f_lseek() on a file opened for reading, clamped to the size
+	ms->pos = ofs < ms->size ? ofs : ms->size;
+	return FR_OK;
+}
+
+static DWORD mem_tell(waveSource *src) {
+	return ((memSource*) src)->pos;
+}
+
+static DWORD mem_size(waveSource *src) {
+	return ((memSource*) src)->size;
+}
+
+static void mem_close(waveSource *src) {
+	(void) src;
+}
+
+static const struct waveSourceVMT memVMT = {
+	mem_read, mem_seek, mem_tell, mem_size, mem_close
+};
+
+void memSourceInit(memSource *ms, const void *data, size_t size) {
+	ms->src.vmt = &memVMT;
+	ms->data = data;
+	ms->size = size;
+	ms->pos = 0;
+}
+
+/*
+ * Serial channel. The first SOURCE_SERIAL_HEAD bytes are kept as they
+ * arrive, reads behind the received data are served from there.
+ */
+static FRESULT serial_read(waveSource *src, void *buf, UINT btr, UINT *br) {
+	serialSource *ss = (serialSource*) src;
+	uint8_t *p = buf;
+	UINT n = 0;
+
+	if (ss->pos < ss->received) {
+		n = ss->received - ss->pos;
+		if (n > btr) n = btr;
+		memcpy(p, ss->head + ss->pos, n);
+	}
+	while (n < btr) {
+		size_t got = chnReadTimeout(ss->chp, p + n, btr - n, ss->timeout);
+		if (!got)
+			break;
+		if (ss->received < SOURCE_SERIAL_HEAD) {
+			size_t keep = SOURCE_SERIAL_HEAD - ss->received;
+			memcpy(ss->head + ss->received, p + n, got < keep ? got : keep);
+		}
+		ss->received += got;
+		n += got;
+	}
+	ss->pos += n;
+	*br = n;
+	return FR_OK;
+}
+
+static FRESULT serial_seek(waveSource *src, DWORD ofs) {
+	serialSource *ss = (serialSource*) src;
+	uint8_t skip[32];
+	UINT br;
+
+	if (ofs <= ss->received) {
+		if (ofs < ss->received && ss->received > SOURCE_SERIAL_HEAD)
+			return FR_INT_ERR;
+		ss->pos = ofs;
+		return FR_OK;
+	}
+	ss->pos = ss->received;
+	while (ss->pos < ofs) {
+		serial_read(src, skip, ofs - ss->pos < sizeof(skip) ? ofs - ss->pos : sizeof(skip), &br);
+		if (!br)
+			break;
+	}
+	return FR_OK;
+}
+
+static DWORD serial_tell(waveSource *src) {
+	return ((serialSource*) src)->pos;
+}
+
+static DWORD serial_size(waveSource *src) {
+	(void) src;
+	return SOURCE_SIZE_UNKNOWN;
+}
+
+static void serial_close(waveSource *src) {
+	(void) src;
+}
+
+static const struct waveSourceVMT serialVMT = {
+	serial_read, serial_seek, serial_tell, serial_size, serial_close
+};
+
+void serialSourceInit(serialSource *ss, BaseChannel *chp, systime_t timeout) {
+	ss->src.vmt = &serialVMT;
+	ss->chp = chp;
+	ss->timeout = timeout;
+	ss->pos = 0;
+	ss->received = 0;
+}
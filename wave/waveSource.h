@@ -0,0 +1,95 @@
+/*
+ * waveSource.h
+ *
+ * Byte sources the player reads wave files from. As with ChibiOS streams
+ * a source is a structure whose first member points to its method table:
+ * implementations embed a waveSource first and the player only calls
+ * srcRead() and friends, so files, memory, serial links and test doubles
+ * all play through the same refill code. Results are FatFs codes, which
+ * the player already handles for files.
+ */
+
+#ifndef WAVESOURCE_H_
+#define WAVESOURCE_H_
+
+#include "hal.h"
+#include "ff.h"
+
+#define SOURCE_SIZE_UNKNOWN		0xFFFFFFFFUL
+
+/*
+ * Bytes at the start of a serial stream kept for seeking back, enough
+ * for the header window of the player.
+ */
+#if !defined(SOURCE_SERIAL_HEAD)
+#define SOURCE_SERIAL_HEAD		512
+#endif
+
+typedef struct _waveSource waveSource;
+
+struct waveSourceVMT {
+	FRESULT	(*read)(waveSource *src, void *buf, UINT btr, UINT *br);
+	FRESULT	(*seek)(waveSource *src, DWORD ofs);
+	DWORD	(*tell)(waveSource *src);
+	DWORD	(*size)(waveSource *src);		// SOURCE_SIZE_UNKNOWN for streams
+	void	(*close)(waveSource *src);
+};
+
+struct _waveSource {
+	const struct waveSourceVMT *vmt;
+};
+
+#define srcRead(src, buf, btr, br)	((src)->vmt->read(src, buf, btr, br))
+#define srcSeek(src, ofs)			((src)->vmt->seek(src, ofs))
+#define srcTell(src)				((src)->vmt->tell(src))
+#define srcSize(src)				((src)->vmt->size(src))
+#define srcClose(src)				((src)->vmt->close(src))
+
+/*
+ * A file on a FatFs volume.
+ */
+typedef struct _fileSource
+{
+	waveSource	src;
+	FIL			file;
+} fileSource;
+
+/*
+ * A wave file image in memory: RAM, or flash as it is memory mapped.
+ */
+typedef struct _memSource
+{
+	waveSource	src;
+	const uint8_t	*data;
+	DWORD		size;
+	DWORD		pos;
+} memSource;
+
+/*
+ * A wave file streamed over a serial channel. Reads wait up to "timeout"
+ * for data, a timeout ends the stream. Seeks go forward by skipping data
+ * and back only within the first SOURCE_SERIAL_HEAD bytes.
+ */
+typedef struct _serialSource
+{
+	waveSource	src;
+	BaseChannel	*chp;
+	systime_t	timeout;
+	DWORD		pos;				// stream offset of the next read
+	DWORD		received;			// bytes received so far
+	uint8_t		head[SOURCE_SERIAL_HEAD];
+} serialSource;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FRESULT fileSourceOpen(fileSource *fs, const char *path);
+size_t fileSourceCount(void);
+void memSourceInit(memSource *ms, const void *data, size_t size);
+void serialSourceInit(serialSource *ss, BaseChannel *chp, systime_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WAVESOURCE_H_ */